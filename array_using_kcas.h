@@ -16,24 +16,49 @@
 template<class KCASProviderType>
 class ArrayUsingKCAS {
 public:
+    typedef typename KCASProviderType::word_t word_t;
     volatile char padding0[PADDING_BYTES];
     KCASProviderType provider;
-    casword_t * data;
+    word_t * data;
+    word_t volatile ** addrs; // &data[i] for each i (for snapshots)
     const int size;
     const int K;
+    const int numCompares; // how many of the K words are only compared (validated), not incremented
     volatile char padding1[PADDING_BYTES];
 
-    ArrayUsingKCAS(const int _size, const int _K) : size(_size), K(_K) {
+    ArrayUsingKCAS(const int _size, const int _K, const int _numCompares = 0, const int numThreads = MAX_THREADS)
+            : provider(numThreads), size(_size), K(_K), numCompares(_numCompares) {
         const int dummyTid = 0;
-        data = new casword_t[_size];
+        data = new word_t[_size];
+        addrs = new word_t volatile *[_size];
         for (int i=0;i<_size;++i) {
             provider.writeInitVal(dummyTid, &data[i], 0);
+            addrs[i] = &data[i];
         }
     }
     ~ArrayUsingKCAS() {
         delete[] data;
+        delete[] addrs;
     }
     bool atomicIncrementRandomK(const int tid, PaddedRandom & rng) {
+        return provider.kcas(tid, prepareIncrementRandomK(tid, rng, 0));
+    }
+    // prepare batchSize kcas operations (each in its own descriptor slot), then perform them all.
+    // returns how many of them succeeded.
+    int atomicIncrementRandomKBatch(const int tid, PaddedRandom & rng, const int batchSize) {
+        assert(batchSize <= KCAS_SLOTS_PER_THREAD);
+        decltype(provider.getDescriptor(tid)) ptrs[KCAS_SLOTS_PER_THREAD];
+        for (int slot=0;slot<batchSize;++slot) {
+            ptrs[slot] = prepareIncrementRandomK(tid, rng, slot);
+        }
+        int succeeded = 0;
+        for (int slot=0;slot<batchSize;++slot) {
+            if (provider.kcas(tid, ptrs[slot])) ++succeeded;
+        }
+        return succeeded;
+    }
+    // fill in (but don't perform) a kcas that increments K random words, using the given descriptor slot
+    decltype(provider.getDescriptor(0)) prepareIncrementRandomK(const int tid, PaddedRandom & rng, const int slot) {
         /**
          * 
          * Choose K indices to perform KCAS on:
@@ -48,19 +73,73 @@ public:
         }
         
         // Create a new KCAS descriptor and populate it with rows containing: addr, exp, new
-        auto ptr = provider.getDescriptor(tid);
+        // (the last numCompares indices just need to still contain what we read)
+        auto ptr = provider.getDescriptor(tid, slot);
         for (int i=0;i<K;++i) {
-            casword_t * addr = &data[ix[i]];
+            word_t * addr = &data[ix[i]];
             casword_t oldval = provider.readVal(tid, &data[ix[i]]);
-            casword_t newval = oldval+1;
-            ptr->addValAddr(addr, oldval, newval);
+            if (i >= K - numCompares) {
+                ptr->addValCompare(addr, oldval);
+            } else {
+                casword_t newval = oldval+1;
+                ptr->addValAddr(addr, oldval, newval);
+            }
         }
-        
-        // Perform the actual kcas
+        return ptr;
+    }
+    /**
+     * Exclusion check (benchmark_kcas -e), for compare-only entries:
+     * the array words are locks (0 or 1) in pairs (2j, 2j+1), and a word can
+     * only be locked while its partner is unlocked. We lock word i with a kcas
+     * that writes i from 0 to 1, and only compares its partner to 0 (for odd i,
+     * that compare-only entry is the first one once the entries are sorted).
+     * While we hold i, our partner can't be locked (that would need i to be 0),
+     * so seeing it locked means some kcas succeeded even though its
+     * compare-only word didn't hold the expected value.
+     */
+    // try to lock a random word. returns its index, or -1 if we didn't get it.
+    int tryLockRandomWord(const int tid, PaddedRandom & rng) {
+        const int ix = rng.nextNatural() % (size & ~1);
+        auto ptr = provider.getDescriptor(tid);
+        ptr->addValAddr(&data[ix], 0, 1);
+        ptr->addValCompare(&data[ix^1], 0);
+        return provider.kcas(tid, ptr) ? ix : -1;
+    }
+    bool partnerUnlocked(const int tid, const int ix) {
+        return provider.readVal(tid, &data[ix^1]) == 0;
+    }
+    void unlockWord(const int tid, const int ix) {
+        auto ptr = provider.getDescriptor(tid);
+        ptr->addValAddr(&data[ix], 1, 0);
         bool result = provider.kcas(tid, ptr);
-        
+        assert(result);
+    }
+    // does a snapshot of the array contain a pair with both words locked?
+    bool snapshotHasLockedPair(const int tid) {
+        casword_t * vals = new casword_t[size];
+        provider.readManyVal(tid, size, addrs, vals);
+        bool result = false;
+        for (int i=0;i+1<size;i+=2) {
+            if (vals[i] && vals[i+1]) result = true;
+        }
+        delete[] vals;
+        return result;
+    }
+    void registerMetrics(MetricsRegistry & registry) {
+        provider.registerMetrics(registry);
+    }
+    // sum of the array as of some moment while the benchmark runs (a snapshot)
+    long long getTotalSnapshot(const int tid) {
+        casword_t * vals = new casword_t[size];
+        provider.readManyVal(tid, size, addrs, vals);
+        long long result = 0;
+        for (int i=0;i<size;++i) {
+            result += vals[i];
+        }
+        delete[] vals;
         return result;
     }
+    // sum of the array (only correct once all threads have stopped)
     long long getTotal(const int tidForReading) {
         long long result = 0;
         for (int i=0;i<size;++i) {
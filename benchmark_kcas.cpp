@@ -10,7 +10,12 @@
 
 #include "globals.h"
 #include "util.h"
+#include "metrics.h"
 #include "kcas_reuse_impl.h"
+#include "kcas_efficient.h"
+#include "kcas_wide.h"
+#include "kcas_locking.h"
+#include "kcas_hybrid.h"
 #include "kcas_unfinished.h"
 #include "array_using_kcas.h"
 
@@ -33,12 +38,18 @@ struct globals_t {
     DataStructureType * ds;
     debugCounter numSuccessfulOps;    // already has padding built in at the beginning and end
     debugCounter numTotalOps;      // already has padding built in at the beginning and end
+    debugCounter numSnapshots;     // snapshots taken by snapshot reader threads
+    debugCounter numBadSnapshots;  // snapshots that could not have been taken at any one moment
+    debugCounter numViolations;    // exclusion check: times we held a word while its partner was locked
     int millisToRun;
     int totalThreads;
+    int snapshotThreads;
     int K;
+    int batchSize;              // kcas operations each thread prepares before performing them
+    bool exclusionCheck;        // lock words with compare-only partners instead of incrementing (see ArrayUsingKCAS)
     volatile char padding7[PADDING_BYTES];
     
-    globals_t(int _millisToRun, int _totalThreads, int _K, DataStructureType * _ds) {
+    globals_t(int _millisToRun, int _totalThreads, int _snapshotThreads, int _K, int _batchSize, bool _exclusionCheck, DataStructureType * _ds) {
         for (int i=0;i<MAX_THREADS;++i) {
             rngs[i].setSeed(i+1); // +1 because we don't want thread 0 to get a seed of 0, since seeds of 0 usually mean all random numbers are zero...
         }
@@ -48,7 +59,10 @@ struct globals_t {
         running = 0;
         millisToRun = _millisToRun;
         totalThreads = _totalThreads;
+        snapshotThreads = _snapshotThreads;
         K = _K;
+        batchSize = _batchSize;
+        exclusionCheck = _exclusionCheck;
         ds = _ds;
     }
     ~globals_t() {
@@ -57,10 +71,17 @@ struct globals_t {
 } __attribute__((aligned(PADDING_BYTES)));
 
 template <class KCASProvider>
-void runExperiment(int arraySize, int millisToRun, int totalThreads, int K) {
+void runExperiment(int arraySize, int millisToRun, int totalThreads, int snapshotThreads, int K, int numCompares, int batchSize, bool exclusionCheck, const metrics_options_t & metricsOptions) {
     // create globals struct that all threads will access (with padding to prevent false sharing on control logic meta data)
-    auto sharedArray = new ArrayUsingKCAS<KCASProvider>(arraySize, K);
-    auto g = new globals_t<ArrayUsingKCAS<KCASProvider>>(millisToRun, totalThreads, K, sharedArray);
+    // the main thread uses tid 0, and reader threads come after the workers
+    auto sharedArray = new ArrayUsingKCAS<KCASProvider>(arraySize, K, numCompares, totalThreads + snapshotThreads);
+    auto g = new globals_t<ArrayUsingKCAS<KCASProvider>>(millisToRun, totalThreads, snapshotThreads, K, batchSize, exclusionCheck, sharedArray);
+    
+    MetricsRegistry metrics;
+    g->ds->registerMetrics(metrics);
+    metrics.addGauge("completed_ops", [g]() { return (double) g->numTotalOps.getTotal(); });
+    metrics.addGauge("successful_ops", [g]() { return (double) g->numSuccessfulOps.getTotal(); });
+    metrics.addGauge("reader_snapshots", [g]() { return (double) g->numSnapshots.getTotal(); });
     
     /**
      * 
@@ -86,18 +107,59 @@ void runExperiment(int arraySize, int millisToRun, int totalThreads, int K) {
                     }
 
                     VERBOSE if (cnt&&((cnt % 1000000) == 0)) TPRINT("op# "<<cnt<<endl);
-                    bool result = g->ds->atomicIncrementRandomK(tid, g->rngs[tid]);
+                    if (g->exclusionCheck) {
+                        int ix = g->ds->tryLockRandomWord(tid, g->rngs[tid]);
+                        g->numTotalOps.inc(tid);
+                        if (ix >= 0) {
+                            g->numSuccessfulOps.inc(tid);
+                            if (!g->ds->partnerUnlocked(tid, ix)) g->numViolations.inc(tid);
+                            g->ds->unlockWord(tid, ix);
+                        }
+                    } else if (g->batchSize == 1) {
+                        bool result = g->ds->atomicIncrementRandomK(tid, g->rngs[tid]);
 
-                    // Count successful and total kcas operations
-                    g->numTotalOps.inc(tid);
-                    if (result) g->numSuccessfulOps.inc(tid);
+                        // Count successful and total kcas operations
+                        g->numTotalOps.inc(tid);
+                        if (result) g->numSuccessfulOps.inc(tid);
+                    } else {
+                        int succeeded = g->ds->atomicIncrementRandomKBatch(tid, g->rngs[tid], g->batchSize);
+                        g->numTotalOps.add(tid, g->batchSize);
+                        g->numSuccessfulOps.add(tid, succeeded);
+                    }
                 }
                 g->running.fetch_add(-1);
                 //TPRINT("terminated"<<endl);
         });
     }
+
+    // create and start snapshot reader threads, which repeatedly snapshot the whole array.
+    // every successful kcas adds K-numCompares to the sum of the array, and entries only increase,
+    // so every snapshot's sum must be a multiple of K-numCompares, and must not be smaller than the last one.
+    // (for the exclusion check, no snapshot may contain a pair with both words locked.)
+    const long long incrementsPerKcas = exclusionCheck ? 0 : K - numCompares;
+    for (int tid=g->totalThreads;tid<g->totalThreads+g->snapshotThreads;++tid) {
+        threads[tid] = new thread([&, tid]() {
+                g->running.fetch_add(1);
+                while (!g->start) { TRACE TPRINT("waiting to start"<<endl); } // wait to start
+
+                long long lastSum = 0;
+                while (!g->done) {
+                    if (g->exclusionCheck) {
+                        if (g->ds->snapshotHasLockedPair(tid)) g->numBadSnapshots.inc(tid);
+                    } else {
+                        long long sum = g->ds->getTotalSnapshot(tid);
+                        if (sum < lastSum || (incrementsPerKcas > 0 && sum % incrementsPerKcas != 0)) {
+                            g->numBadSnapshots.inc(tid);
+                        }
+                        lastSum = sum;
+                    }
+                    g->numSnapshots.inc(tid);
+                }
+                g->running.fetch_add(-1);
+        });
+    }
     
-    while (g->running < g->totalThreads) {
+    while (g->running < g->totalThreads + g->snapshotThreads) {
         TRACE cout<<"main thread: waiting for threads to START running="<<g->running<<endl;
     } // wait for all threads to be ready
     
@@ -107,14 +169,20 @@ void runExperiment(int arraySize, int millisToRun, int totalThreads, int K) {
     
     g->start = true; // release all threads from the barrier, so they can work
 
-    while (g->running > 0) { /* wait for all threads to stop working */ }
+    long long nextSnapshotMillis = metricsOptions.periodMillis;
+    while (g->running > 0) { /* wait for all threads to stop working */
+        if (metricsOptions.periodMillis > 0 && g->timer.getElapsedMillis() >= nextSnapshotMillis) {
+            metrics.snapshot(g->timer.getElapsedMillis());
+            nextSnapshotMillis += metricsOptions.periodMillis;
+        }
+    }
     
     // measure and print elapsed time
     g->elapsedMillis = g->timer.getElapsedMillis();
     cout<<(g->elapsedMillis/1000.)<<"s"<<endl;
     
     // join all threads
-    for (int tid=0;tid<g->totalThreads;++tid) {
+    for (int tid=0;tid<g->totalThreads+g->snapshotThreads;++tid) {
         threads[tid]->join();
         delete threads[tid];
     }
@@ -132,19 +200,41 @@ void runExperiment(int arraySize, int millisToRun, int totalThreads, int K) {
     auto sumOfEntries = g->ds->getTotal(0 /* dummy thread ID */);
     cout<<"TOTAL="<<sumOfEntries<<endl;
 
-    cout<<"Validation: # successful KCAS = "<<successfulOps<<" and K = "<<g->K<<" so array sum should be "<<(successfulOps*g->K)<<".";
-    cout<<((successfulOps*g->K == sumOfEntries) ? " OK." : " FAILED.")<<endl;
+    auto violations = g->numViolations.getTotal();
+    if (g->exclusionCheck) {
+        // every word we locked was unlocked again, so the array sum should be 0
+        cout<<"Validation: # words locked = "<<successfulOps<<" with "<<violations<<" exclusion violations, and array sum should be 0.";
+    } else {
+        cout<<"Validation: # successful KCAS = "<<successfulOps<<" and K = "<<g->K<<" ("<<numCompares<<" compare-only) so array sum should be "<<(successfulOps*incrementsPerKcas)<<".";
+    }
+    cout<<((successfulOps*incrementsPerKcas == sumOfEntries && violations == 0) ? " OK." : " FAILED.")<<endl;
     cout<<endl;
 
     cout<<"completed ops        : "<<numTotalOps<<endl;
     cout<<"throughput           : "<<(long long) (numTotalOps * 1000. / g->elapsedMillis)<<endl;
     cout<<"elapsed milliseconds : "<<g->elapsedMillis<<endl;
+    if (g->snapshotThreads > 0) {
+        cout<<"snapshots            : "<<g->numSnapshots.getTotal()<<endl;
+        cout<<"bad snapshots        : "<<g->numBadSnapshots.getTotal()<<endl;
+    }
+    cout<<endl;
+    
+    metrics.snapshot(g->elapsedMillis);
+    cout<<"provider statistics (all zero if compiled with -DNO_STATS):"<<endl;
+    metrics.printLatest(cout);
     cout<<endl;
+    if (!metrics.writeFiles(metricsOptions)) {
+        cout<<"ERROR: could not write metrics file"<<endl;
+    }
     
-    if (successfulOps*g->K != sumOfEntries) {
+    if (successfulOps*incrementsPerKcas != sumOfEntries || violations > 0) {
         cout<<"ERROR: validation failed!"<<endl;
         exit(-1);
     }
+    if (g->numBadSnapshots.getTotal() > 0) {
+        cout<<"ERROR: snapshot validation failed!"<<endl;
+        exit(-1);
+    }
     
     delete g;
 }
@@ -153,11 +243,24 @@ int main(int argc, char** argv) {
     if (argc == 1) {
         cout<<"USAGE: "<<argv[0]<<" [options]"<<endl;
         cout<<"Options:"<<endl;
-        cout<<"    -a [string]  algorithm name in { lockfree, unfinished }"<<endl;
+        cout<<"    -a [string]  algorithm name in { lockfree, efficient, wide, locking, hybrid, unfinished }"<<endl;
+        cout<<"    -m [string]  contention policy for lockfree in { immediate, backoff, priority } (default: immediate)"<<endl;
         cout<<"    -t [int]     milliseconds to run"<<endl;
         cout<<"    -s [int]     size of array that KCAS will be performed on"<<endl;
         cout<<"    -n [int]     number of threads that will perform KCAS"<<endl;
+        cout<<"    -q [int]     number of additional threads that will repeatedly take snapshots of the array (default: 0)"<<endl;
         cout<<"    -k [int]     the K in KCAS (how many slots to operate on)"<<endl;
+        cout<<"    -r [int]     how many of the K slots are only compared (read-validated), not incremented (default: 0)"<<endl;
+        cout<<"    -b [int]     how many kcas operations each thread prepares (in different descriptor slots) before performing them (default: 1, at most "<<KCAS_SLOTS_PER_THREAD<<")"<<endl;
+        cout<<"    -e           exclusion check: instead of incrementing, lock random words with a kcas that compares the word's partner to 0 (so K = 2, with 1 compare-only word, and -k, -r and -b are ignored)"<<endl;
+        cout<<"    -f           make hybrid always use its (lock-free) fallback path, even if the cpu supports RTM"<<endl;
+        cout<<"    -x [string]  htm backend in { auto, hardware, software } (default: auto = hardware if the cpu has RTM)"<<endl;
+        cout<<"    -xa [int]    percent of transactions to abort on purpose, without trying them (software backend: all of them)"<<endl;
+        cout<<"    -xc [int]    percent of those aborts to report as conflicts (with the retry hint)"<<endl;
+        cout<<"    -xk [int]    percent of those aborts to report as capacity aborts"<<endl;
+        cout<<"    -p [int]     take a metrics snapshot every p milliseconds (default: only at the end)"<<endl;
+        cout<<"    -j [string]  write metrics snapshots to this file as JSON"<<endl;
+        cout<<"    -c [string]  write metrics snapshots to this file as CSV"<<endl;
         cout<<endl;
         cout<<"Example: "<<argv[0]<<" -a lockfree -t 1000 -s 1000000 -n 8 -k 4"<<endl;
         return 1;
@@ -166,8 +269,14 @@ int main(int argc, char** argv) {
     int millisToRun = -1;
     int arraySize = 0;
     int totalThreads = 0;
+    int snapshotThreads = 0;
     int K = 0;
+    int numCompares = 0;
+    int batchSize = 1;
+    bool exclusionCheck = false;
     char * alg = NULL;
+    const char * policy = "immediate";
+    metrics_options_t metricsOptions;
     
     // read command line args
     for (int i=1;i<argc;++i) {
@@ -175,18 +284,53 @@ int main(int argc, char** argv) {
             arraySize = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-n") == 0) {
             totalThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0) {
+            snapshotThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            metricsOptions.periodMillis = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0) {
+            metricsOptions.jsonFile = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0) {
+            metricsOptions.csvFile = argv[++i];
         } else if (strcmp(argv[i], "-t") == 0) {
             millisToRun = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-a") == 0) {
             alg = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0) {
+            policy = argv[++i];
         } else if (strcmp(argv[i], "-k") == 0) {
             K = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            numCompares = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-x") == 0) {
+            if (!htm_set_backend(argv[++i])) {
+                cout<<"bad htm backend (or no RTM on this cpu): "<<argv[i]<<endl;
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "-xa") == 0) {
+            htm_options.abortPercent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-xc") == 0) {
+            htm_options.conflictPercent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-xk") == 0) {
+            htm_options.capacityPercent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            kcas_htm_force_fallback = true;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            batchSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0) {
+            exclusionCheck = true;
         } else {
             cout<<"bad arguments"<<endl;
             exit(1);
         }
     }
     
+    if (exclusionCheck) {
+        K = 2;
+        numCompares = 1;
+        batchSize = 1;
+    }
+    
     // print command and args for debugging
     std::cout<<"Cmd:";
     for (int i=0;i<argc;++i) {
@@ -198,20 +342,32 @@ int main(int argc, char** argv) {
     PRINT(MAX_THREADS);
     PRINT(KCAS_MAXK);
     PRINT(K);
+    PRINT(policy);
+    PRINT(numCompares);
+    PRINT(batchSize);
+    PRINT(exclusionCheck);
+    PRINT(htm_cpu_has_rtm());
+    PRINT(htm_backend_name());
+    PRINT(htm_options.abortPercent);
+    PRINT(htm_options.conflictPercent);
+    PRINT(htm_options.capacityPercent);
+    PRINT(kcas_htm_force_fallback);
     PRINT(millisToRun);
     PRINT(arraySize);
     PRINT(totalThreads);
+    PRINT(snapshotThreads);
+    PRINT(metricsOptions.periodMillis);
     cout<<endl;
     
     // check for too large thread count
-    if (totalThreads >= MAX_THREADS) {
-        std::cout<<"ERROR: totalThreads="<<totalThreads<<" >= MAX_THREADS="<<MAX_THREADS<<std::endl;
+    if (totalThreads + snapshotThreads >= MAX_THREADS) {
+        std::cout<<"ERROR: totalThreads+snapshotThreads="<<(totalThreads+snapshotThreads)<<" >= MAX_THREADS="<<MAX_THREADS<<std::endl;
         return 1;
     }
     
-    // check for size too small
-    if (arraySize < KCAS_MAXK) {
-        std::cout<<"ERROR: arraySize="<<arraySize<<" < KCAS_MAXK="<<KCAS_MAXK<<std::endl;
+    // check for size too small (the exclusion check only needs K distinct words)
+    if (arraySize < (exclusionCheck ? K : KCAS_MAXK)) {
+        std::cout<<"ERROR: arraySize="<<arraySize<<" < "<<(exclusionCheck ? "K=" : "KCAS_MAXK=")<<(exclusionCheck ? K : KCAS_MAXK)<<std::endl;
         return 1;
     }
     
@@ -222,17 +378,42 @@ int main(int argc, char** argv) {
     }
     
     // check for K too small or too large
-    if (K < 2 || K > KCAS_MAXK) {
-        cout<<"K must be between 2 and KCAS_MAXK (which is currently "<<KCAS_MAXK<<")."<<endl;
+    if (K < 1 || K > KCAS_MAXK) {
+        cout<<"K must be between 1 and KCAS_MAXK (which is currently "<<KCAS_MAXK<<")."<<endl;
         cout<<"If you want to perform larger KCAS operations, increase KCAS_MAXK."<<endl;
         return 1;
     }
     
+    if (numCompares < 0 || numCompares > K) {
+        cout<<"The number of compare-only slots must be between 0 and K."<<endl;
+        return 1;
+    }
+    
+    if (batchSize < 1 || batchSize > KCAS_SLOTS_PER_THREAD) {
+        cout<<"The batch size must be between 1 and KCAS_SLOTS_PER_THREAD (which is currently "<<KCAS_SLOTS_PER_THREAD<<")."<<endl;
+        return 1;
+    }
+    
     // run experiment for the selected KCAS implementation
-    if (!strcmp(alg, "lockfree")) {
-        runExperiment<KCASLockFree<KCAS_MAXK>>(arraySize, millisToRun, totalThreads, K);
+    if (!strcmp(alg, "lockfree") && !strcmp(policy, "immediate")) {
+        runExperiment<KCASLockFree<KCAS_MAXK, KCASHelpImmediately>>(arraySize, millisToRun, totalThreads, snapshotThreads, K, numCompares, batchSize, exclusionCheck, metricsOptions);
+    } else if (!strcmp(alg, "lockfree") && !strcmp(policy, "backoff")) {
+        runExperiment<KCASLockFree<KCAS_MAXK, KCASBackoffThenHelp>>(arraySize, millisToRun, totalThreads, snapshotThreads, K, numCompares, batchSize, exclusionCheck, metricsOptions);
+    } else if (!strcmp(alg, "lockfree") && !strcmp(policy, "priority")) {
+        runExperiment<KCASLockFree<KCAS_MAXK, KCASPriorityByTid>>(arraySize, millisToRun, totalThreads, snapshotThreads, K, numCompares, batchSize, exclusionCheck, metricsOptions);
+    } else if (!strcmp(alg, "efficient")) {
+        runExperiment<KCASEfficient<KCAS_MAXK>>(arraySize, millisToRun, totalThreads, snapshotThreads, K, numCompares, batchSize, exclusionCheck, metricsOptions);
+    } else if (!strcmp(alg, "wide")) {
+        runExperiment<KCASWide<KCAS_MAXK>>(arraySize, millisToRun, totalThreads, snapshotThreads, K, numCompares, batchSize, exclusionCheck, metricsOptions);
+    } else if (!strcmp(alg, "locking")) {
+        runExperiment<KCASLocking<KCAS_MAXK>>(arraySize, millisToRun, totalThreads, snapshotThreads, K, numCompares, batchSize, exclusionCheck, metricsOptions);
+    } else if (!strcmp(alg, "hybrid")) {
+        runExperiment<KCASHybrid<KCAS_MAXK>>(arraySize, millisToRun, totalThreads, snapshotThreads, K, numCompares, batchSize, exclusionCheck, metricsOptions);
     } else if (!strcmp(alg, "unfinished")) {
-        runExperiment<KCASUnfinished<KCAS_MAXK>>(arraySize, millisToRun, totalThreads, K);
+        runExperiment<KCASUnfinished<KCAS_MAXK>>(arraySize, millisToRun, totalThreads, snapshotThreads, K, numCompares, batchSize, exclusionCheck, metricsOptions);
+    } else if (!strcmp(alg, "lockfree")) {
+        cout<<"Bad contention policy: "<<policy<<endl;
+        return 1;
     } else {
         cout<<"Bad algorithm name: "<<alg<<endl;
         return 1;
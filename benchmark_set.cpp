@@ -12,6 +12,7 @@ using namespace std;
 
 #include "globals.h"
 #include "util.h"
+#include "metrics.h"
 #include "set_unfinished.h"
 #include "set_hashtable_lockfree.h"
 
@@ -58,11 +59,15 @@ struct globals_t {
 } __attribute__((aligned(PADDING_BYTES)));
 
 template <class DataStructureType>
-void runExperiment(int keyRangeSize, int millisToRun, int totalThreads) {
+void runExperiment(int keyRangeSize, int initialSize, int millisToRun, int totalThreads, const set_options_t & options, const metrics_options_t & metricsOptions) {
     // create globals struct that all threads will access (with padding to prevent false sharing on control logic meta data)
-    auto dataStructure = new DataStructureType(totalThreads, keyRangeSize);
+    auto dataStructure = new DataStructureType(totalThreads, initialSize, options);
     auto g = new globals_t<DataStructureType>(millisToRun, totalThreads, keyRangeSize, dataStructure);
     
+    MetricsRegistry metrics;
+    g->ds->registerMetrics(metrics);
+    metrics.addGauge("completed_ops", [g]() { return (double) g->numTotalOps.getTotal(); });
+    
     /**
      * 
      * RUN EXPERIMENT
@@ -99,7 +104,6 @@ void runExperiment(int keyRangeSize, int millisToRun, int totalThreads) {
                     if (operationType < 0.5) {
                         auto result = g->ds->insertIfAbsent(tid, key);
                         if (result==1) g->keyChecksum.add(tid, key);
-                        else if (result==2) cout << "Expansion at m/s: " << g->timer.getElapsedMillis() << endl;
                     } else {
                         auto result = g->ds->erase(tid, key);
                         if (result) g->keyChecksum.add(tid, -key);
@@ -123,7 +127,13 @@ void runExperiment(int keyRangeSize, int millisToRun, int totalThreads) {
     
     g->start = true; // release all threads from the barrier, so they can work
     
-    while (g->running > 0) { /* wait for all threads to stop working */ }
+    long long nextSnapshotMillis = metricsOptions.periodMillis;
+    while (g->running > 0) { /* wait for all threads to stop working */
+        if (metricsOptions.periodMillis > 0 && g->timer.getElapsedMillis() >= nextSnapshotMillis) {
+            metrics.snapshot(g->timer.getElapsedMillis());
+            nextSnapshotMillis += metricsOptions.periodMillis;
+        }
+    }
     
     // measure and print elapsed time
     g->elapsedMillis = g->timer.getElapsedMillis();
@@ -157,6 +167,11 @@ void runExperiment(int keyRangeSize, int millisToRun, int totalThreads) {
     cout<<"END OF TEST"<<endl;
     cout<<endl;
     
+    metrics.snapshot(g->elapsedMillis);
+    if (!metrics.writeFiles(metricsOptions)) {
+        cout<<"ERROR: could not write metrics file"<<endl;
+    }
+    
     if (threadsSumOfKeys != dsSumOfKeys) {
         cout<<"ERROR: validation failed!"<<endl;
         exit(-1);
@@ -169,10 +184,21 @@ int main(int argc, char** argv) {
     if (argc == 1) {
         cout<<"USAGE: "<<argv[0]<<" [options]"<<endl;
         cout<<"Options:"<<endl;
-        cout<<"    -a [string]  algorithm name in { unfinished }"<<endl;
+        cout<<"    -a [string]  algorithm name in { unfinished, hashtable, htmhash }"<<endl;
         cout<<"    -t [int]     milliseconds to run"<<endl;
         cout<<"    -s [int]     size of the key range that random keys will be drawn from (i.e., range [1, s])"<<endl;
         cout<<"    -n [int]     number of threads that will perform inserts and deletes"<<endl;
+        cout<<"    -i [int]     initial size the data structure is created with (default: s); use a small value to make it grow under load"<<endl;
+        cout<<"    -r [int]     1 to let inserts reuse tombstones (hashtable only; default 0)"<<endl;
+        cout<<"    -g [int]     growth mode for htmhash: 0 = stop-the-world expansion, 1 = incremental migration (default 0)"<<endl;
+        cout<<"    -b [int]     1 to erase with backward-shift deletion instead of tombstones (htmhash only; default 0)"<<endl;
+        cout<<"    -x [string]  htm backend in { auto, hardware, software } (default: auto = hardware if the cpu has RTM)"<<endl;
+        cout<<"    -xa [int]    percent of transactions to abort on purpose, without trying them (software backend: all of them)"<<endl;
+        cout<<"    -xc [int]    percent of those aborts to report as conflicts (with the retry hint)"<<endl;
+        cout<<"    -xk [int]    percent of those aborts to report as capacity aborts"<<endl;
+        cout<<"    -p [int]     take a metrics snapshot every p milliseconds (default: only at the end)"<<endl;
+        cout<<"    -j [string]  write metrics snapshots to this file as JSON"<<endl;
+        cout<<"    -c [string]  write metrics snapshots to this file as CSV"<<endl;
         cout<<endl;
         cout<<"Example: "<<argv[0]<<" -a unfinished -t 5000 -s 1000000 -n 8"<<endl;
         return 1;
@@ -180,8 +206,11 @@ int main(int argc, char** argv) {
     
     int millisToRun = -1;
     int keyRangeSize = 0;
+    int initialSize = 0;
     int totalThreads = 0;
     char * alg = NULL;
+    set_options_t options;
+    metrics_options_t metricsOptions;
     
     // read command line args
     for (int i=1;i<argc;++i) {
@@ -189,6 +218,31 @@ int main(int argc, char** argv) {
             keyRangeSize = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-n") == 0) {
             totalThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            initialSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            options.reuseTombstones = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-g") == 0) {
+            options.incrementalGrowth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            options.backwardShift = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-x") == 0) {
+            if (!htm_set_backend(argv[++i])) {
+                cout<<"bad htm backend (or no RTM on this cpu): "<<argv[i]<<endl;
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "-xa") == 0) {
+            htm_options.abortPercent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-xc") == 0) {
+            htm_options.conflictPercent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-xk") == 0) {
+            htm_options.capacityPercent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            metricsOptions.periodMillis = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0) {
+            metricsOptions.jsonFile = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0) {
+            metricsOptions.csvFile = argv[++i];
         } else if (strcmp(argv[i], "-t") == 0) {
             millisToRun = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-a") == 0) {
@@ -199,6 +253,8 @@ int main(int argc, char** argv) {
         }
     }
     
+    if (initialSize <= 0) initialSize = keyRangeSize;
+    
     // print command and args for debugging
     std::cout<<"Cmd:";
     for (int i=0;i<argc;++i) {
@@ -210,7 +266,17 @@ int main(int argc, char** argv) {
     PRINT(MAX_THREADS);
     PRINT(millisToRun);
     PRINT(keyRangeSize);
+    PRINT(initialSize);
     PRINT(totalThreads);
+    PRINT(options.reuseTombstones);
+    PRINT(options.incrementalGrowth);
+    PRINT(options.backwardShift);
+    PRINT(htm_cpu_has_rtm());
+    PRINT(htm_backend_name());
+    PRINT(htm_options.abortPercent);
+    PRINT(htm_options.conflictPercent);
+    PRINT(htm_options.capacityPercent);
+    PRINT(metricsOptions.periodMillis);
     cout<<endl;
     
     // check for too large thread count
@@ -227,11 +293,11 @@ int main(int argc, char** argv) {
     
     // run experiment for the selected algorithm
     if (!strcmp(alg, "unfinished")) {
-        runExperiment<SetUnfinished>(keyRangeSize, millisToRun, totalThreads);
+        runExperiment<SetUnfinished>(keyRangeSize, initialSize, millisToRun, totalThreads, options, metricsOptions);
     } else if (!strcmp(alg, "hashtable")) {
-        runExperiment<SetHashTableLockfree>(keyRangeSize, millisToRun, totalThreads);
+        runExperiment<SetHashTableLockfree>(keyRangeSize, initialSize, millisToRun, totalThreads, options, metricsOptions);
     } else if (!strcmp(alg, "htmhash")) {
-        runExperiment<Hlock>(keyRangeSize, millisToRun, totalThreads);
+        runExperiment<Hlock>(keyRangeSize, initialSize, millisToRun, totalThreads, options, metricsOptions);
     }else {
         cout<<"Bad algorithm name: "<<alg<<endl;
         return 1;
@@ -0,0 +1,119 @@
+/**
+ * A single-threaded microbenchmark for sorting KCAS descriptors:
+ * for each K, how long does it take to sort a descriptor with K entries
+ * using the old bubble sort, insertion sort, and the sorting network
+ * that kcas() now uses (kcas_sort.h)?
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+
+#include "globals.h"
+#include "util.h"
+#include "metrics.h"
+#include "kcas_reuse_impl.h"
+
+using namespace std;
+
+#define SORT_MAXK KCAS_MAXK
+#define NUM_DESCRIPTORS 1024
+
+struct sortdesc_t {
+    casword_t numEntries;
+    kcasentry_t entries[SORT_MAXK];
+};
+
+// the sort kcas() used to do
+static void bubbleSort(sortdesc_t * ptr) {
+    kcasentry_t temp;
+    for (int i = 0; i < ptr->numEntries; i++) {
+        for (int j = 0; j < ptr->numEntries - i - 1; j++) {
+            if (ptr->entries[j].addr > ptr->entries[j + 1].addr) {
+                temp = ptr->entries[j];
+                ptr->entries[j] = ptr->entries[j + 1];
+                ptr->entries[j + 1] = temp;
+            }
+        }
+    }
+}
+
+static void insertionSort(sortdesc_t * ptr) {
+    kcas_insertion_sort(ptr->entries, ptr->numEntries);
+}
+
+static void networkSort(sortdesc_t * ptr) {
+    kcas_sort_by_addr<SORT_MAXK>(ptr->entries, ptr->numEntries);
+}
+
+static void noSort(sortdesc_t * ptr) {}
+
+static bool isSorted(sortdesc_t * ptr) {
+    for (int i = 1; i < ptr->numEntries; ++i) {
+        if (ptr->entries[i-1].addr > ptr->entries[i].addr) return false;
+    }
+    return true;
+}
+
+sortdesc_t inputs[NUM_DESCRIPTORS];
+sortdesc_t scratch;
+
+// average nanoseconds to copy and sort one descriptor (checks every result is sorted)
+template <typename SortFunc>
+double timeSort(SortFunc sort, const int reps, bool * sorted) {
+    auto start = chrono::high_resolution_clock::now();
+    for (int r = 0; r < reps; ++r) {
+        scratch = inputs[r % NUM_DESCRIPTORS];
+        sort(&scratch);
+        if (r < NUM_DESCRIPTORS && sort != noSort && !isSorted(&scratch)) *sorted = false;
+        __asm__ __volatile__("" ::: "memory"); // don't let the compiler skip or merge sorts
+    }
+    auto end = chrono::high_resolution_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(end - start).count() / (double) reps;
+}
+
+int main(int argc, char** argv) {
+    int reps = 1000000;
+    int maxK = SORT_MAXK;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-r") == 0) {
+            reps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0) {
+            maxK = atoi(argv[++i]);
+        } else {
+            cout<<"USAGE: "<<argv[0]<<" [-r sorts per K and method] [-k max K (at most "<<SORT_MAXK<<")]"<<endl;
+            exit(1);
+        }
+    }
+    if (maxK < 1 || maxK > SORT_MAXK || reps < 1) {
+        cout<<"bad arguments"<<endl;
+        exit(1);
+    }
+    PRINT(reps);
+    PRINT(maxK);
+
+    PaddedRandom rng;
+    rng.setSeed(1);
+    bool sorted = true;
+    cout<<"average ns to copy and sort one descriptor (copy is the cost of just copying it)"<<endl;
+    cout<<setw(4)<<"K"<<setw(12)<<"copy"<<setw(12)<<"bubble"<<setw(12)<<"insertion"<<setw(12)<<"network"<<endl;
+    for (int K = 1; K <= maxK; ++K) {
+        for (int d = 0; d < NUM_DESCRIPTORS; ++d) {
+            inputs[d].numEntries = K;
+            for (int i = 0; i < K; ++i) {
+                inputs[d].entries[i].addr = (casword_t volatile *) (uintptr_t) (rng.nextNatural() & ~7u);
+                inputs[d].entries[i].oldval = i;
+                inputs[d].entries[i].newval = i + 1;
+            }
+        }
+        cout<<fixed<<setprecision(2)<<setw(4)<<K
+            <<setw(12)<<timeSort(noSort, reps, &sorted)
+            <<setw(12)<<timeSort(bubbleSort, reps, &sorted)
+            <<setw(12)<<timeSort(insertionSort, reps, &sorted)
+            <<setw(12)<<timeSort(networkSort, reps, &sorted)<<endl;
+    }
+    cout<<"Validation: every sorted descriptor was in address order. "<<(sorted ? "OK." : "FAILED!")<<endl;
+    return sorted ? 0 : 1;
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <immintrin.h>
+#include <cpuid.h>
+#include <cassert>
+#include <cstring>
+#include "globals.h"
+#include "util.h"
+#include "metrics.h"
+
+/**
+ * A thin wrapper around RTM (_xbegin/_xend/_xabort), so HTM-based code can
+ * run on machines without TSX, and so its fallback paths can be exercised on
+ * purpose.
+ *
+ * Usage is the same as the intrinsics:
+ *     unsigned status = htm_begin(tid);
+ *     if (status == HTM_STARTED) { ...; htm_abort(CODE); ...; htm_end(); }
+ *     else { ... look at status (HTM_ABORT_EXPLICIT, HTM_ABORT_CODE(status), ...) and fall back ... }
+ *
+ * Backends:
+ * - hardware: real RTM (the default when CPUID says the cpu has it).
+ * - software: htm_begin never starts a transaction; it returns an abort
+ *   status instead, so every operation runs its fallback path (the default
+ *   when the cpu has no RTM, where _xbegin would be an illegal instruction).
+ *   We don't emulate committing transactions (e.g., with a global lock):
+ *   code that runs next to transactions (lock-free CASes, a fallback lock's
+ *   holder) relies on its writes aborting them, and nothing can abort a
+ *   software transaction, so it would not be atomic.
+ *
+ * With either backend, htm_options.abortPercent of the calls to htm_begin
+ * return an abort status without trying (the software backend aborts all of
+ * them regardless). The reason reported is a conflict (with the retry hint)
+ * conflictPercent of the time, a capacity abort capacityPercent of the time,
+ * and otherwise a status with no reason bits (like an interrupt).
+ */
+
+#define HTM_STARTED _XBEGIN_STARTED
+#define HTM_ABORT_EXPLICIT _XABORT_EXPLICIT
+#define HTM_ABORT_RETRY _XABORT_RETRY
+#define HTM_ABORT_CONFLICT _XABORT_CONFLICT
+#define HTM_ABORT_CAPACITY _XABORT_CAPACITY
+#define HTM_ABORT_DEBUG _XABORT_DEBUG
+#define HTM_ABORT_NESTED _XABORT_NESTED
+#define HTM_ABORT_CODE(status) _XABORT_CODE(status)
+
+// must be called inside a transaction (so only with the hardware backend), and code must be a constant
+#define htm_abort(code) _xabort(code)
+
+enum htm_backend_t { HTM_BACKEND_HARDWARE, HTM_BACKEND_SOFTWARE };
+
+// does this cpu support RTM? (CPUID leaf 7, subleaf 0: EBX bit 11)
+static bool htm_cpu_has_rtm() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+    return (ebx & (1<<11)) != 0;
+}
+
+struct htm_options_t {
+    htm_backend_t backend;
+    int abortPercent;       // abort this % of htm_begin calls without trying (software: always 100)
+    int conflictPercent;    // % of those aborts that report a conflict (and the retry hint)
+    int capacityPercent;    // % of those aborts that report a capacity abort
+    htm_options_t()
+        : backend(htm_cpu_has_rtm() ? HTM_BACKEND_HARDWARE : HTM_BACKEND_SOFTWARE)
+        , abortPercent(0), conflictPercent(0), capacityPercent(0) {}
+};
+
+static htm_options_t htm_options; // set these before any thread calls htm_begin
+static struct htm_rngs_t { // for injecting aborts
+    PaddedRandom rngs[MAX_THREADS];
+    htm_rngs_t() { for (int i=0;i<MAX_THREADS;++i) rngs[i].setSeed(i+1); }
+} htm_rngs;
+
+static const char * htm_backend_name() {
+    return (htm_options.backend == HTM_BACKEND_HARDWARE) ? "hardware" : "software";
+}
+
+// sets the backend from a name in { auto, hardware, software }; returns false for a bad name,
+// or for hardware on a cpu without RTM
+static bool htm_set_backend(const char * name) {
+    if (!strcmp(name, "auto")) {
+        htm_options.backend = htm_cpu_has_rtm() ? HTM_BACKEND_HARDWARE : HTM_BACKEND_SOFTWARE;
+    } else if (!strcmp(name, "hardware") && htm_cpu_has_rtm()) {
+        htm_options.backend = HTM_BACKEND_HARDWARE;
+    } else if (!strcmp(name, "software")) {
+        htm_options.backend = HTM_BACKEND_SOFTWARE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static unsigned htm_injected_abort(const int tid) {
+    const int r = htm_rngs.rngs[tid].nextNatural() % 100;
+    if (r < htm_options.conflictPercent) return HTM_ABORT_CONFLICT | HTM_ABORT_RETRY;
+    if (r < htm_options.conflictPercent + htm_options.capacityPercent) return HTM_ABORT_CAPACITY;
+    return 0;
+}
+
+static inline unsigned htm_begin(const int tid) {
+    if (htm_options.backend == HTM_BACKEND_SOFTWARE) {
+        return htm_injected_abort(tid);
+    }
+    if (htm_options.abortPercent > 0) {
+        if ((int) (htm_rngs.rngs[tid].nextNatural() % 100) < htm_options.abortPercent) return htm_injected_abort(tid);
+    }
+    return _xbegin();
+}
+
+static inline void htm_end() {
+    assert(htm_options.backend == HTM_BACKEND_HARDWARE);
+    _xend();
+}
+
+/**
+ * Abort-reason telemetry for code that uses htm_begin.
+ * Record every abort (with its status), every commit (with the number of
+ * htm_begin calls the operation needed), and every operation that gave up on
+ * HTM and took its fallback path. Counters are per thread (StatCounter), so
+ * this is cheap, and free with -DNO_STATS.
+ *
+ * An abort can have several reason bits (e.g., conflict and retry), so the
+ * reason counts can add up to more than the number of aborts. Explicit aborts
+ * are also counted per code (codes >= HTM_STATS_CODES share the last bucket);
+ * give the codes you use names with nameCode() to have them reported.
+ */
+
+#ifndef HTM_STATS_CODES
+#define HTM_STATS_CODES 16
+#endif
+#ifndef HTM_STATS_ATTEMPTS
+#define HTM_STATS_ATTEMPTS 8 // commits after 1, 2, ..., HTM_STATS_ATTEMPTS-1 attempts, and after more
+#endif
+
+class HTMAbortStats {
+private:
+    StatCounter commits;
+    StatCounter fallbacks;
+    StatCounter aborts;
+    StatCounter conflict;
+    StatCounter capacity;
+    StatCounter explicitAborts;
+    StatCounter nested;
+    StatCounter retryHint;
+    StatCounter noReason;   // no reason bits (e.g., an interrupt, or the software backend)
+    StatCounter explicitCodes[HTM_STATS_CODES];
+    StatCounter commitAttempts[HTM_STATS_ATTEMPTS];
+    StatCounter totalCommitAttempts;
+    const char * codeNames[HTM_STATS_CODES];
+public:
+    HTMAbortStats() {
+        for (int i=0;i<HTM_STATS_CODES;++i) codeNames[i] = NULL;
+    }
+    void init(const int numThreads) {
+        commits.init(numThreads);
+        fallbacks.init(numThreads);
+        aborts.init(numThreads);
+        conflict.init(numThreads);
+        capacity.init(numThreads);
+        explicitAborts.init(numThreads);
+        nested.init(numThreads);
+        retryHint.init(numThreads);
+        noReason.init(numThreads);
+        for (int i=0;i<HTM_STATS_CODES;++i) explicitCodes[i].init(numThreads);
+        for (int i=0;i<HTM_STATS_ATTEMPTS;++i) commitAttempts[i].init(numThreads);
+        totalCommitAttempts.init(numThreads);
+    }
+    void nameCode(const int code, const char * name) {
+        codeNames[(code < HTM_STATS_CODES) ? code : HTM_STATS_CODES-1] = name;
+    }
+
+    void recordAbort(const int tid, const unsigned status) {
+        aborts.inc(tid);
+        if (status & HTM_ABORT_CONFLICT) conflict.inc(tid);
+        if (status & HTM_ABORT_CAPACITY) capacity.inc(tid);
+        if (status & HTM_ABORT_NESTED) nested.inc(tid);
+        if (status & HTM_ABORT_RETRY) retryHint.inc(tid);
+        if (status & HTM_ABORT_EXPLICIT) {
+            explicitAborts.inc(tid);
+            const int code = HTM_ABORT_CODE(status);
+            explicitCodes[(code < HTM_STATS_CODES) ? code : HTM_STATS_CODES-1].inc(tid);
+        }
+        if ((status & (HTM_ABORT_CONFLICT | HTM_ABORT_CAPACITY | HTM_ABORT_NESTED | HTM_ABORT_RETRY | HTM_ABORT_EXPLICIT | HTM_ABORT_DEBUG)) == 0) {
+            noReason.inc(tid);
+        }
+    }
+    void recordCommit(const int tid, const int attempts) {
+        commits.inc(tid);
+        commitAttempts[(attempts < HTM_STATS_ATTEMPTS) ? attempts-1 : HTM_STATS_ATTEMPTS-1].inc(tid);
+        totalCommitAttempts.add(tid, attempts);
+    }
+    void recordFallback(const int tid) {
+        fallbacks.inc(tid);
+    }
+
+    // both are 0 (not nan) before anything has committed or fallen back
+    double fallbackFraction() {
+        const long long total = commits.read() + fallbacks.read();
+        return total ? fallbacks.read() / (double) total : 0;
+    }
+    double attemptsPerCommit() {
+        const long long n = commits.read();
+        return n ? totalCommitAttempts.read() / (double) n : 0;
+    }
+
+    void print(std::ostream & out) {
+        out<<"htm_commits: "<<commits.read()<<std::endl;
+        out<<"htm_fallbacks: "<<fallbacks.read()<<std::endl;
+        out<<"htm_fallback_fraction: "<<fallbackFraction()<<std::endl;
+        out<<"htm_attempts_per_commit: "<<attemptsPerCommit()<<std::endl;
+        out<<"htm_commits_by_attempts:";
+        for (int i=0;i<HTM_STATS_ATTEMPTS;++i) {
+            out<<" "<<(i+1)<<(i == HTM_STATS_ATTEMPTS-1 ? "+" : "")<<"="<<commitAttempts[i].read();
+        }
+        out<<std::endl;
+        out<<"htm_aborts: "<<aborts.read()<<std::endl;
+        out<<"htm_abort_conflict: "<<conflict.read()<<std::endl;
+        out<<"htm_abort_capacity: "<<capacity.read()<<std::endl;
+        out<<"htm_abort_explicit: "<<explicitAborts.read()<<std::endl;
+        for (int i=0;i<HTM_STATS_CODES;++i) {
+            if (codeNames[i] || explicitCodes[i].read()) {
+                out<<"htm_abort_explicit_"<<(codeNames[i] ? codeNames[i] : "code")<<"("<<i<<(i == HTM_STATS_CODES-1 ? "+" : "")<<"): "<<explicitCodes[i].read()<<std::endl;
+            }
+        }
+        out<<"htm_abort_nested: "<<nested.read()<<std::endl;
+        out<<"htm_abort_retry_hint: "<<retryHint.read()<<std::endl;
+        out<<"htm_abort_no_reason: "<<noReason.read()<<std::endl;
+    }
+
+    void registerMetrics(MetricsRegistry & registry) {
+        registry.addCounter("htm_commits", &commits);
+        registry.addCounter("htm_fallbacks", &fallbacks);
+        registry.addGauge("htm_fallback_fraction", [this]() { return fallbackFraction(); });
+        registry.addGauge("htm_attempts_per_commit", [this]() { return attemptsPerCommit(); });
+        for (int i=0;i<HTM_STATS_ATTEMPTS;++i) {
+            registry.addCounter("htm_commits_after_" + std::to_string(i+1) + (i == HTM_STATS_ATTEMPTS-1 ? "+" : ""), &commitAttempts[i]);
+        }
+        registry.addCounter("htm_aborts", &aborts);
+        registry.addCounter("htm_abort_conflict", &conflict);
+        registry.addCounter("htm_abort_capacity", &capacity);
+        registry.addCounter("htm_abort_explicit", &explicitAborts);
+        for (int i=0;i<HTM_STATS_CODES;++i) {
+            if (codeNames[i]) registry.addCounter(std::string("htm_abort_explicit_") + codeNames[i], &explicitCodes[i]);
+        }
+        registry.addCounter("htm_abort_nested", &nested);
+        registry.addCounter("htm_abort_retry_hint", &retryHint);
+        registry.addCounter("htm_abort_no_reason", &noReason);
+    }
+};
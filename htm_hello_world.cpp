@@ -1,11 +1,18 @@
-#include <immintrin.h>
+#include <cstdio>
 #include <iostream>
+#include "htm.h"
 using namespace std;
 
 int main(int argc, char ** argv) {
+    if (argc > 1 && !htm_set_backend(argv[1])) {
+        cout<<"USAGE: "<<argv[0]<<" [htm backend in { auto, hardware, software }]"<<endl;
+        return 1;
+    }
+    cout<<"cpu has rtm: "<<htm_cpu_has_rtm()<<endl;
+    cout<<"htm backend: "<<htm_backend_name()<<endl;
     int status;
-    if ((status = _xbegin()) == _XBEGIN_STARTED) {
-        _xend();
+    if ((status = htm_begin(0)) == HTM_STARTED) {
+        htm_end();
         cout<<"committed empty hardware tx successfully"<<endl;
     } else {
         cout<<"aborted empty hardware tx"<<endl;
@@ -0,0 +1,49 @@
+#pragma once
+
+/**
+ * Contention policies for KCASLockFree (its ContentionPolicy template parameter).
+ *
+ * When a kcas (or a read) runs into another thread's kcas descriptor, it can
+ * help that kcas finish right away, or it can first back off for a while in
+ * the hope that the owner finishes on its own. Helping right away is what
+ * makes the algorithm lock-free, but on a small, hot array it can turn into
+ * a helping storm: many threads all executing the same descriptor, and
+ * fighting over the same cache lines.
+ *
+ * A policy decides how many rounds of exponential backoff to do before
+ * helping the owner of a descriptor. Between rounds, the provider checks
+ * whether the descriptor is gone (in which case it doesn't have to help).
+ * The number of rounds is bounded, so every policy is still lock-free.
+ */
+
+#ifndef KCAS_BACKOFF_ROUNDS
+#define KCAS_BACKOFF_ROUNDS 6       // rounds of backoff before helping (for policies that back off)
+#endif
+#ifndef KCAS_BACKOFF_MIN_SPINS
+#define KCAS_BACKOFF_MIN_SPINS 16   // pause instructions in the first round (doubles every round)
+#endif
+
+// help as soon as we see a descriptor (the original behaviour)
+struct KCASHelpImmediately {
+    static const char * name() { return "immediate"; }
+    static int backoffRounds(const int tid, const int ownerTid) { return 0; }
+};
+
+// always back off (exponentially, a bounded number of times) before helping
+struct KCASBackoffThenHelp {
+    static const char * name() { return "backoff"; }
+    static int backoffRounds(const int tid, const int ownerTid) { return KCAS_BACKOFF_ROUNDS; }
+};
+
+// lower thread ids have priority: we get out of the way of (back off for)
+// higher priority threads, and help lower priority threads immediately
+struct KCASPriorityByTid {
+    static const char * name() { return "priority"; }
+    static int backoffRounds(const int tid, const int ownerTid) { return (ownerTid < tid) ? KCAS_BACKOFF_ROUNDS : 0; }
+};
+
+static inline void kcas_backoff_spin(const int round) {
+    for (int i = 0; i < (KCAS_BACKOFF_MIN_SPINS << round); ++i) {
+        __asm__ __volatile__ ("pause":::"memory");
+    }
+}
@@ -0,0 +1,395 @@
+#pragma once
+
+#include "kcas_reuse_impl.h"
+
+/**
+ * A KCAS that needs only about K+1 CASes in the uncontended case:
+ * K CASes to install a pointer to our descriptor in each word,
+ * and one CAS to decide the descriptor's state.
+ * (Based on the ideas in Guerraoui, Kogan, Marathe and Zablotchi,
+ *  "Efficient Multi-word Compare and Swap", DISC 2020.)
+ *
+ * Unlike KCASLockFree, there is no phase 2:
+ * - A word that contains a pointer to a descriptor is interpreted
+ *   according to the descriptor's state. If it is SUCCEEDED, the word's
+ *   value is the entry's newval, and otherwise it is the entry's oldval.
+ *   So, the kcas takes effect (all at once) when its state becomes
+ *   SUCCEEDED, and readers never have to help a kcas.
+ * - Pointers to decided descriptors are simply overwritten by the next kcas
+ *   on that word. Whatever is left is detached (replaced by its value) by the
+ *   owner before it reuses its descriptor, in its next getDescriptor(), so it
+ *   is off the critical path of the kcas that installed it.
+ *
+ * A thread that runs into an undecided descriptor helps it install itself in
+ * its remaining words and then decides it, as in KCASLockFree, so this
+ * algorithm is lock-free. Entries are sorted by address, so the descriptor in
+ * our way only needs words above the one we are looking at, and we only hold
+ * words below it: helping can't go around in a cycle.
+ * Helpers install with RDCSS (which only installs while the descriptor is
+ * still undecided), so a slow helper can't install a descriptor after it has
+ * been decided and the word has been reset to the same value. The owner
+ * installs its first word with a plain CAS, since nobody can find (or
+ * decide) its descriptor before that. An rdcss that read the state before
+ * the decision can still install the descriptor afterwards, so detach()
+ * finishes any rdcss it finds in a word before it looks for our pointer.
+ *
+ * Compare-only entries (addValCompare) are installed and decided like any
+ * other entry here. KCASLockFree can validate them without locking them
+ * because its readers help undecided operations to completion. Ours return
+ * the old values of an undecided kcas instead, so the kcas could not take
+ * effect at the moment its compare-only words were validated.
+ *
+ * Descriptors are reused with sequence numbers exactly as in KCASLockFree
+ * (kcas_reuse_impl.h), and have the same type, so data structures that use
+ * the KCAS provider interface work unchanged.
+ */
+
+template <int MAX_K>
+class KCASEfficient {
+public:
+    typedef casword_t word_t;
+private:
+    volatile char __padding_desc[128];
+    const int numThreads;       // tids are in [0, numThreads)
+    kcasdesc_t<MAX_K> * kcasDescriptors; // KCAS_SLOTS_PER_THREAD per thread (see KCAS_DESC_INDEX)
+    rdcssdesc_t * rdcssDescriptors;      // one per thread
+    kcasclock_t * clocks;                // KCAS_CLOCKS of them (see kcasclock_t)
+    volatile char __padding_desc3[128];
+    StatCounter kcas_succeeded;
+    StatCounter kcas_failed;
+    StatCounter kcas_helped;    // undecided descriptors of other threads we helped
+    StatCounter rdcss_helped;   // rdcss descriptors of other threads we helped
+    StatCounter detached_words; // words still pointing to our previous descriptor when we reused it
+    StatCounter snapshots;      // readMany calls
+    StatCounter snapshot_retries; // extra collects readMany needed because words changed
+    volatile char __padding_desc4[128];
+
+public:
+    KCASEfficient(const int _numThreads = MAX_THREADS);
+    ~KCASEfficient();
+    void writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval);
+    void writeInitVal(const int tid, casword_t volatile * addr, casword_t const newval);
+    casword_t readPtr(const int tid, casword_t volatile * addr);
+    casword_t readVal(const int tid, casword_t volatile * addr);
+    void readManyPtr(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out);
+    void readManyVal(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out);
+    bool kcas(const int tid, kcasptr_t ptr);
+    kcasptr_t getDescriptor(const int tid, const int slot = 0);
+    void registerMetrics(MetricsRegistry & registry);
+private:
+    bool kcas1(const int tid, kcasptr_t ptr);
+    bool valueOf(kcastagptr_t tagptr, casword_t volatile * addr, casword_t * value, int * state);
+    void help(const int tid, kcastagptr_t tagptr, kcasptr_t snapshot, bool helpingOther);
+    void helpOther(const int tid, kcastagptr_t tagptr);
+    void detach(const int tid, const int index);
+    casword_t rdcss(const int tid, rdcssptr_t ptr, rdcsstagptr_t tagptr);
+    void rdcssHelp(rdcsstagptr_t tagptr, rdcssptr_t snapshot);
+    void rdcssHelpOther(const int tid, rdcsstagptr_t tagptr);
+};
+
+template <int MAX_K>
+KCASEfficient<MAX_K>::KCASEfficient(const int _numThreads) : numThreads(_numThreads) {
+    assert(numThreads > 0 && numThreads*KCAS_SLOTS_PER_THREAD < LAST_TID-1);
+    kcasDescriptors = new kcasdesc_t<MAX_K>[numThreads*KCAS_SLOTS_PER_THREAD];
+    DESC_INIT_ALL(kcasDescriptors, KCAS_SEQBITS_NEW, numThreads*KCAS_SLOTS_PER_THREAD);
+    for (int i=0;i<numThreads*KCAS_SLOTS_PER_THREAD;++i) {
+        kcasDescriptors[i].numEntries = 0;
+    }
+    rdcssDescriptors = new rdcssdesc_t[numThreads];
+    DESC_INIT_ALL(rdcssDescriptors, RDCSS_SEQBITS_NEW, numThreads);
+    clocks = kcas_clocks_new();
+    kcas_succeeded.init(numThreads);
+    kcas_failed.init(numThreads);
+    kcas_helped.init(numThreads);
+    rdcss_helped.init(numThreads);
+    detached_words.init(numThreads);
+    snapshots.init(numThreads);
+    snapshot_retries.init(numThreads);
+}
+
+template <int MAX_K>
+KCASEfficient<MAX_K>::~KCASEfficient() {
+    delete[] kcasDescriptors;
+    delete[] rdcssDescriptors;
+    delete[] clocks;
+}
+
+/**
+ * Determine the value of addr, which contains tagptr, according to the
+ * descriptor tagptr points to. Also returns the descriptor's state.
+ * Returns false if the descriptor has been reused (so addr no longer contains
+ * tagptr, and the caller should reread it).
+ */
+template <int MAX_K>
+bool KCASEfficient<MAX_K>::valueOf(kcastagptr_t tagptr, casword_t volatile * addr, casword_t * value, int * state) {
+    kcasptr_t ptr = TAGPTR_UNPACK_PTR(kcasDescriptors, tagptr);
+    bool successBit;
+    *state = DESC_READ_FIELD(successBit, ptr->seqBits, tagptr, KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
+    if (!successBit) return false;
+    __asm__ __volatile__ ("":::"memory"); // read the entries after the sequence number
+    const int n = ptr->numEntries;
+    int i = 0;
+    while (i < n && ptr->entries[i].addr != addr) ++i;
+    if (i == n) return false;
+    *value = decidedValue(ptr->entries[i], *state == KCAS_STATE_SUCCEEDED);
+    __asm__ __volatile__ ("":::"memory"); // read the entry before rechecking the sequence number (see DESC_SNAPSHOT)
+    return (ptr->seqBits & MASK_SEQ) == (tagptr & MASK_SEQ);
+}
+
+// (rdcss is as in KCASLockFree, but addr1 is always the seqBits of one of our kcas descriptors)
+template <int MAX_K>
+void KCASEfficient<MAX_K>::rdcssHelp(rdcsstagptr_t tagptr, rdcssptr_t snapshot) {
+    bool readSuccess;
+    casword_t v = DESC_READ_FIELD(readSuccess, *snapshot->addr1, snapshot->old1, KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
+    if (!readSuccess) v = KCAS_STATE_SUCCEEDED; // the kcas descriptor has been reused, so it was decided
+    if (v == KCAS_STATE_UNDECIDED) {
+        BOOL_CAS(snapshot->addr2, (casword_t) tagptr, snapshot->new2);
+    } else {
+        BOOL_CAS(snapshot->addr2, (casword_t) tagptr, snapshot->old2);
+    }
+}
+
+template <int MAX_K>
+void KCASEfficient<MAX_K>::rdcssHelpOther(const int tid, rdcsstagptr_t tagptr) {
+    rdcssdesc_t snapshot;
+    rdcss_helped.inc(tid);
+    if (DESC_SNAPSHOT(rdcssdesc_t, rdcssDescriptors, &snapshot, tagptr, rdcssdesc_t::size)) {
+        rdcssHelp(tagptr, &snapshot);
+    }
+}
+
+template <int MAX_K>
+casword_t KCASEfficient<MAX_K>::rdcss(const int tid, rdcssptr_t ptr, rdcsstagptr_t tagptr) {
+    casword_t r;
+    do {
+        r = VAL_CAS(ptr->addr2, ptr->old2, (casword_t) tagptr);
+        if (isRdcss(r)) rdcssHelpOther(tid, (rdcsstagptr_t) r);
+    } while (isRdcss(r));
+    if (r == ptr->old2) rdcssHelp(tagptr, ptr); // finish our own operation
+    return r;
+}
+
+/**
+ * Install the descriptor (that tagptr points to) in each of its words that
+ * doesn't contain it yet, then decide it. snapshot is the descriptor itself
+ * if we are its owner, and a copy of it if we are helping.
+ */
+template <int MAX_K>
+void KCASEfficient<MAX_K>::help(const int tid, kcastagptr_t tagptr, kcasptr_t snapshot, bool helpingOther) {
+    kcasptr_t ptr = TAGPTR_UNPACK_PTR(kcasDescriptors, tagptr);
+    int newstate = KCAS_STATE_SUCCEEDED;
+    // the owner installs entry 0 before anyone can find the descriptor, so helpers start at entry 1
+    for (int i = helpingOther; i < snapshot->numEntries; i++) {
+        casword_t volatile * addr = snapshot->entries[i].addr;
+retry_entry:
+        casword_t content = *addr;
+        if (content == (casword_t) tagptr) continue; // someone installed it already
+        if (isRdcss(content)) {
+            rdcssHelpOther(tid, (rdcsstagptr_t) content);
+            goto retry_entry;
+        }
+        casword_t val = content;
+        if (isKcas(content)) {
+            int state;
+            if (!valueOf((kcastagptr_t) content, addr, &val, &state)) goto retry_entry;
+            if (state == KCAS_STATE_UNDECIDED) {
+                helpOther(tid, (kcastagptr_t) content);
+                // someone might have decided us while we were helping
+                if ((ptr->seqBits & KCAS_SEQBITS_MASK_STATE) != KCAS_STATE_UNDECIDED) break;
+                goto retry_entry;
+            }
+        }
+        if (val != snapshot->entries[i].oldval) {
+            newstate = KCAS_STATE_FAILED;
+            break;
+        }
+        if (!helpingOther && i == 0) {
+            if (!BOOL_CAS(addr, content, (casword_t) tagptr)) goto retry_entry;
+        } else {
+            rdcssdesc_t *rdcssptr = DESC_NEW(rdcssDescriptors, RDCSS_SEQBITS_NEW, tid);
+            rdcssptr->addr1 = (casword_t*) &ptr->seqBits;
+            rdcssptr->old1 = tagptr; // pass the sequence number (as part of tagptr)
+            rdcssptr->old2 = content; // (a pointer to a decided descriptor is replaced directly)
+            rdcssptr->addr2 = addr;
+            rdcssptr->new2 = (casword_t) tagptr;
+            DESC_INITIALIZED(rdcssDescriptors, tid);
+            if (rdcss(tid, rdcssptr, TAGPTR_NEW(tid, rdcssptr->seqBits, RDCSS_TAGBIT)) != content) goto retry_entry;
+        }
+    }
+
+    // decide (unless someone else did first)
+    if (newstate == KCAS_STATE_SUCCEEDED) kcas_tick_clocks(clocks, snapshot);
+    bool successBit;
+    SEQBITS_CAS_FIELD(successBit
+            , ptr->seqBits, snapshot->seqBits
+            , KCAS_STATE_UNDECIDED, newstate
+            , KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
+}
+
+template <int MAX_K>
+void KCASEfficient<MAX_K>::helpOther(const int tid, kcastagptr_t tagptr) {
+    kcasdesc_t<MAX_K> snapshot;
+    if (!KCASDESC_SNAPSHOT(kcasdesc_t<MAX_K>, kcasDescriptors, &snapshot, tagptr)) return;
+    kcas_helped.inc(tid);
+    help(tid, tagptr, &snapshot, true);
+}
+
+/**
+ * Replace any pointers to our (decided) descriptor that are still in memory
+ * by the values they represent, so the descriptor can be reused.
+ */
+template <int MAX_K>
+void KCASEfficient<MAX_K>::detach(const int tid, const int index) {
+    kcasptr_t ptr = &kcasDescriptors[index];
+    kcastagptr_t tagptr = TAGPTR_NEW(index, ptr->seqBits, KCAS_TAGBIT);
+    bool succeeded = ((ptr->seqBits & KCAS_SEQBITS_MASK_STATE) == KCAS_STATE_SUCCEEDED);
+    for (int i = 0; i < ptr->numEntries; i++) {
+        casword_t volatile * addr = ptr->entries[i].addr;
+        while (1) {
+            casword_t content = *addr;
+            // an rdcss in this word might still install our descriptor, so finish it first
+            if (isRdcss(content)) {
+                rdcssHelpOther(tid, (rdcsstagptr_t) content);
+                continue;
+            }
+            if (content != (casword_t) tagptr) break;
+            if (BOOL_CAS(addr, content, decidedValue(ptr->entries[i], succeeded))) detached_words.inc(tid);
+        }
+    }
+}
+
+// a 1-word kcas is just a CAS (a decided descriptor in the word is simply replaced by the new value)
+template <int MAX_K>
+bool KCASEfficient<MAX_K>::kcas1(const int tid, kcasptr_t ptr) {
+    casword_t volatile * addr = ptr->entries[0].addr;
+    casword_t volatile * clock = kcas_clock_of(clocks, addr);
+    while (1) {
+        casword_t content = *addr;
+        if (isRdcss(content)) {
+            rdcssHelpOther(tid, (rdcsstagptr_t) content);
+            continue;
+        }
+        casword_t val = content;
+        if (isKcas(content)) {
+            int state;
+            if (!valueOf((kcastagptr_t) content, addr, &val, &state)) continue;
+            if (state == KCAS_STATE_UNDECIDED) {
+                helpOther(tid, (kcastagptr_t) content);
+                continue;
+            }
+        }
+        if (val != ptr->entries[0].oldval) return false;
+        if (isCompareOnly(ptr->entries[0])) return true;
+        if (kcas_clocked_cas(clock, [&]() { return BOOL_CAS(addr, content, ptr->entries[0].newval); })) return true;
+    }
+}
+
+template <int MAX_K>
+bool KCASEfficient<MAX_K>::kcas(const int tid, kcasptr_t ptr) {
+    if (ptr->numEntries == 1) {
+        bool result = kcas1(tid, ptr);
+        if (result) kcas_succeeded.inc(tid);
+        else kcas_failed.inc(tid);
+        return result;
+    }
+
+    // sort entries in the kcas descriptor to guarantee progress
+    if (!(ptr->numEntries == 2 ? kcasdesc_sort2(ptr) : kcasdesc_sort<MAX_K>(ptr))) {
+        kcas_failed.inc(tid);
+        return false;
+    }
+    const int index = ptr - kcasDescriptors; // which of our slots
+    assert(KCAS_DESC_OWNER(index) == tid);
+    DESC_INITIALIZED(kcasDescriptors, index);
+    kcastagptr_t tagptr = TAGPTR_NEW(index, ptr->seqBits, KCAS_TAGBIT);
+
+    help(tid, tagptr, ptr, false);
+    bool result = ((ptr->seqBits & KCAS_SEQBITS_MASK_STATE) == KCAS_STATE_SUCCEEDED);
+    if (result) kcas_succeeded.inc(tid);
+    else kcas_failed.inc(tid);
+    return result;
+}
+
+template <int MAX_K>
+casword_t KCASEfficient<MAX_K>::readPtr(const int tid, casword_t volatile * addr) {
+    while (1) {
+        casword_t r = *addr;
+        if (isRdcss(r)) {
+            rdcssHelpOther(tid, (rdcsstagptr_t) r);
+            continue;
+        }
+        if (!isKcas(r)) return r;
+        casword_t val;
+        int state;
+        if (valueOf((kcastagptr_t) r, addr, &val, &state)) return val;
+    }
+}
+
+template <int MAX_K>
+casword_t KCASEfficient<MAX_K>::readVal(const int tid, casword_t volatile * addr) {
+    return ((casword_t) readPtr(tid, addr))>>KCAS_LEFTSHIFT;
+}
+
+// a linearizable snapshot of n words (see kcas_double_collect), validated with our write clocks
+template <int MAX_K>
+void KCASEfficient<MAX_K>::readManyPtr(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out) {
+    int retries = kcas_double_collect(n, addrs, out, [this, tid](casword_t volatile * addr, casword_t * raw) {
+        while (1) {
+            casword_t r = *addr;
+            if (isRdcss(r)) {
+                rdcssHelpOther(tid, (rdcsstagptr_t) r);
+                continue;
+            }
+            *raw = r;
+            if (!isKcas(r)) return r;
+            casword_t val;
+            int state;
+            if (valueOf((kcastagptr_t) r, addr, &val, &state)) return val;
+        }
+    }, [this](casword_t volatile * addr) {
+        return *kcas_clock_of(clocks, addr);
+    });
+    snapshots.inc(tid);
+    snapshot_retries.add(tid, retries);
+}
+
+template <int MAX_K>
+void KCASEfficient<MAX_K>::readManyVal(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out) {
+    readManyPtr(tid, n, addrs, out);
+    for (int i = 0; i < n; i++) {
+        out[i] >>= KCAS_LEFTSHIFT;
+    }
+}
+
+template <int MAX_K>
+void KCASEfficient<MAX_K>::writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval) {
+    *addr = newval;
+}
+
+template <int MAX_K>
+void KCASEfficient<MAX_K>::writeInitVal(const int tid, casword_t volatile * addr, casword_t const newval) {
+    writeInitPtr(tid, addr, newval<<KCAS_LEFTSHIFT);
+}
+
+template <int MAX_K>
+kcasptr_t KCASEfficient<MAX_K>::getDescriptor(const int tid, const int slot) {
+    assert(tid >= 0 && tid < numThreads);
+    assert(slot >= 0 && slot < KCAS_SLOTS_PER_THREAD);
+    // clean up after the previous kcas in this slot, then reuse its descriptor
+    const int index = KCAS_DESC_INDEX(tid, slot);
+    detach(tid, index);
+    kcasptr_t ptr = DESC_NEW(kcasDescriptors, KCAS_SEQBITS_NEW, index);
+    ptr->numEntries = 0;
+    return ptr;
+}
+
+template <int MAX_K>
+void KCASEfficient<MAX_K>::registerMetrics(MetricsRegistry & registry) {
+    registry.addCounter("kcas_succeeded", &kcas_succeeded);
+    registry.addCounter("kcas_failed", &kcas_failed);
+    registry.addCounter("kcas_helped", &kcas_helped);
+    registry.addCounter("rdcss_helped", &rdcss_helped);
+    registry.addCounter("detached_words", &detached_words);
+    registry.addCounter("snapshots", &snapshots);
+    registry.addCounter("snapshot_retries", &snapshot_retries);
+}
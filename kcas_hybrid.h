@@ -0,0 +1,175 @@
+#pragma once
+
+#include "htm.h"
+#include "kcas_reuse_impl.h"
+
+/**
+ * A KCAS that first tries to do the whole thing in a hardware transaction,
+ * and falls back to KCASLockFree's descriptor protocol.
+ *
+ * The transaction reads every word, aborts if one of them contains a
+ * descriptor (a lock-free kcas is in progress there), and otherwise checks
+ * the old values and writes the new values. A lock-free kcas changes a word
+ * with a CAS, which aborts any transaction that has read the word, and
+ * transactions only ever write plain values, so the two paths can run on the
+ * same words at the same time. Reads go straight to KCASLockFree (a word
+ * written by a transaction is just a value, as far as it can tell), and the
+ * transaction ticks the words' write clocks in KCASLockFree, so its snapshots
+ * see the writes too.
+ *
+ * We fall back after KCAS_HTM_ATTEMPTS aborts, or sooner if an abort says
+ * retrying is pointless (a descriptor is in the way, or the transaction
+ * doesn't fit in the cache). Transactions go through htm.h. With its software
+ * backend (the default on a machine without TSX) every transaction would
+ * abort, so, as when kcas_htm_force_fallback is set before the provider is
+ * constructed, we don't even try.
+ */
+
+#ifndef KCAS_HTM_ATTEMPTS
+#define KCAS_HTM_ATTEMPTS 4
+#endif
+
+#define KCAS_HTM_ABORT_DESCRIPTOR 0x1 // explicit abort code: a word contains a descriptor
+
+static bool kcas_htm_force_fallback = false; // runtime switch: never use HTM
+
+template <int MAX_K>
+class KCASHybrid {
+public:
+    typedef casword_t word_t;
+private:
+    volatile char __padding_desc[128];
+    KCASLockFree<MAX_K> fallback;
+    const bool useHTM;
+    volatile char __padding_desc3[128];
+    StatCounter htm_succeeded;  // kcas operations that committed a transaction and succeeded
+    StatCounter htm_failed;     // ... and failed (an old value didn't match)
+    HTMAbortStats htmStats;     // why transactions abort, attempts per commit, and how often we fell back
+    volatile char __padding_desc4[128];
+
+    enum { HTM_SUCCEEDED, HTM_FAILED, HTM_GAVE_UP };
+
+public:
+    KCASHybrid(const int _numThreads = MAX_THREADS);
+    void writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval);
+    void writeInitVal(const int tid, casword_t volatile * addr, casword_t const newval);
+    casword_t readPtr(const int tid, casword_t volatile * addr);
+    casword_t readVal(const int tid, casword_t volatile * addr);
+    void readManyPtr(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out);
+    void readManyVal(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out);
+    bool kcas(const int tid, kcasptr_t ptr);
+    kcasptr_t getDescriptor(const int tid, const int slot = 0);
+    void registerMetrics(MetricsRegistry & registry);
+private:
+    int kcasHTM(const int tid, kcasptr_t ptr);
+};
+
+template <int MAX_K>
+KCASHybrid<MAX_K>::KCASHybrid(const int _numThreads)
+        : fallback(_numThreads)
+        , useHTM(!kcas_htm_force_fallback && htm_options.backend == HTM_BACKEND_HARDWARE) {
+    htm_succeeded.init(_numThreads);
+    htm_failed.init(_numThreads);
+    htmStats.init(_numThreads);
+    htmStats.nameCode(KCAS_HTM_ABORT_DESCRIPTOR, "descriptor");
+}
+
+template <int MAX_K>
+int KCASHybrid<MAX_K>::kcasHTM(const int tid, kcasptr_t ptr) {
+    const int n = ptr->numEntries;
+    for (int attempt = 0; attempt < KCAS_HTM_ATTEMPTS; ++attempt) {
+        unsigned status = htm_begin(tid);
+        if (status == HTM_STARTED) {
+            for (int i = 0; i < n; i++) {
+                casword_t val = *ptr->entries[i].addr;
+                if (isRdcss(val) || isKcas(val)) htm_abort(KCAS_HTM_ABORT_DESCRIPTOR);
+                if (val != ptr->entries[i].oldval) {
+                    htm_end(); // we haven't written anything
+                    htmStats.recordCommit(tid, attempt+1);
+                    return HTM_FAILED;
+                }
+            }
+            for (int i = 0; i < n; i++) {
+                if (!isCompareOnly(ptr->entries[i])) {
+                    *ptr->entries[i].addr = ptr->entries[i].newval;
+                    *fallback.clockOf(ptr->entries[i].addr) += KCAS_CLOCK_WRITE; // (for snapshots, see kcasclock_t)
+                }
+            }
+            htm_end();
+            htmStats.recordCommit(tid, attempt+1);
+            return HTM_SUCCEEDED;
+        }
+        htmStats.recordAbort(tid, status);
+        // a descriptor won't go away unless someone helps it, which the fallback does
+        if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == KCAS_HTM_ABORT_DESCRIPTOR) break;
+        if (status & HTM_ABORT_CAPACITY) break;
+    }
+    return HTM_GAVE_UP;
+}
+
+template <int MAX_K>
+bool KCASHybrid<MAX_K>::kcas(const int tid, kcasptr_t ptr) {
+    // a 1-word kcas is a CAS, which is cheaper than a transaction
+    if (!useHTM || ptr->numEntries == 1) {
+        return fallback.kcas(tid, ptr);
+    }
+
+    // a descriptor that names the same word with two different expected values can never succeed
+    // (sorting also makes the fallback's sort cheap, if we need it)
+    if (!(ptr->numEntries == 2 ? kcasdesc_sort2(ptr) : kcasdesc_sort<MAX_K>(ptr))) {
+        htm_failed.inc(tid);
+        return false;
+    }
+    switch (kcasHTM(tid, ptr)) {
+        case HTM_SUCCEEDED: htm_succeeded.inc(tid); return true;
+        case HTM_FAILED: htm_failed.inc(tid); return false;
+        default: break;
+    }
+    htmStats.recordFallback(tid);
+    return fallback.kcas(tid, ptr);
+}
+
+template <int MAX_K>
+casword_t KCASHybrid<MAX_K>::readPtr(const int tid, casword_t volatile * addr) {
+    return fallback.readPtr(tid, addr);
+}
+
+template <int MAX_K>
+casword_t KCASHybrid<MAX_K>::readVal(const int tid, casword_t volatile * addr) {
+    return fallback.readVal(tid, addr);
+}
+
+template <int MAX_K>
+void KCASHybrid<MAX_K>::readManyPtr(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out) {
+    fallback.readManyPtr(tid, n, addrs, out);
+}
+
+template <int MAX_K>
+void KCASHybrid<MAX_K>::readManyVal(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out) {
+    fallback.readManyVal(tid, n, addrs, out);
+}
+
+template <int MAX_K>
+void KCASHybrid<MAX_K>::writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval) {
+    fallback.writeInitPtr(tid, addr, newval);
+}
+
+template <int MAX_K>
+void KCASHybrid<MAX_K>::writeInitVal(const int tid, casword_t volatile * addr, casword_t const newval) {
+    fallback.writeInitVal(tid, addr, newval);
+}
+
+template <int MAX_K>
+kcasptr_t KCASHybrid<MAX_K>::getDescriptor(const int tid, const int slot) {
+    // a transaction only reads the descriptor, so we can always hand out one the fallback can use
+    return fallback.getDescriptor(tid, slot);
+}
+
+template <int MAX_K>
+void KCASHybrid<MAX_K>::registerMetrics(MetricsRegistry & registry) {
+    registry.addGauge("htm_enabled", [this]() { return (double) useHTM; });
+    registry.addCounter("htm_succeeded", &htm_succeeded);
+    registry.addCounter("htm_failed", &htm_failed);
+    htmStats.registerMetrics(registry);
+    fallback.registerMetrics(registry); // (kcas_succeeded and kcas_failed count only fallback kcas operations)
+}
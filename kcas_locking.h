@@ -0,0 +1,260 @@
+#pragma once
+
+#include <thread>
+#include "kcas_reuse_impl.h"
+
+/**
+ * A blocking KCAS, as a baseline to measure the lock-free providers against.
+ *
+ * Words are mapped to a fixed table of stripe locks (by address).
+ * A kcas locks the stripes of all of its words in increasing stripe order
+ * (so there is no deadlock), checks the old values, writes the new values,
+ * and unlocks. There are no shared descriptors: getDescriptor() just hands
+ * out a per-thread buffer that kcas() reads its arguments from.
+ *
+ * Each stripe lock is also a version number (a seqlock): it is odd while
+ * the stripe is locked, and unlocking after a write adds 2 overall.
+ * A kcas that fails writes nothing, so it puts the old version back.
+ * Reads don't lock. They read the version, then the word, and retry if the
+ * stripe was locked or the version changed in between.
+ *
+ * Values are shifted by KCAS_LEFTSHIFT as in the other providers, so
+ * data structures can use any of them unchanged.
+ */
+
+#ifndef KCAS_LOCKING_STRIPES
+#define KCAS_LOCKING_STRIPES 4096       // must be a power of two
+#endif
+#ifndef KCAS_LOCKING_SPINS_BEFORE_YIELD
+#define KCAS_LOCKING_SPINS_BEFORE_YIELD 1024 // (the lock holder may have been preempted)
+#endif
+
+struct kcasstripe_t {
+    volatile casword_t version; // odd iff locked
+    volatile char padding[PADDING_BYTES-sizeof(casword_t)];
+};
+
+template <int MAX_K>
+class KCASLocking {
+public:
+    typedef casword_t word_t;
+private:
+    volatile char __padding_desc[128];
+    const int numThreads;
+    kcasstripe_t * stripes;              // KCAS_LOCKING_STRIPES of them
+    kcasdesc_t<MAX_K> * kcasDescriptors; // KCAS_SLOTS_PER_THREAD per thread (never seen by other threads)
+    volatile char __padding_desc3[128];
+    StatCounter kcas_succeeded;
+    StatCounter kcas_failed;
+    StatCounter lock_waits;     // times a kcas found a stripe locked and had to wait for it
+    StatCounter read_retries;   // times a read found its stripe locked or changed, and reread it
+    StatCounter snapshots;      // readMany calls
+    StatCounter snapshot_retries; // extra collects readMany needed because words changed
+    volatile char __padding_desc4[128];
+
+public:
+    KCASLocking(const int _numThreads = MAX_THREADS);
+    ~KCASLocking();
+    void writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval);
+    void writeInitVal(const int tid, casword_t volatile * addr, casword_t const newval);
+    casword_t readPtr(const int tid, casword_t volatile * addr);
+    casword_t readVal(const int tid, casword_t volatile * addr);
+    void readManyPtr(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out);
+    void readManyVal(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out);
+    bool kcas(const int tid, kcasptr_t ptr);
+    kcasptr_t getDescriptor(const int tid, const int slot = 0);
+    void registerMetrics(MetricsRegistry & registry);
+private:
+    static int stripeOf(casword_t volatile * addr) {
+        return (int) ((((uintptr_t) addr) / sizeof(casword_t)) & (KCAS_LOCKING_STRIPES-1));
+    }
+    casword_t lock(const int tid, const int stripe);
+    casword_t readVersioned(const int tid, casword_t volatile * addr, casword_t * version);
+};
+
+template <int MAX_K>
+KCASLocking<MAX_K>::KCASLocking(const int _numThreads) : numThreads(_numThreads) {
+    assert((KCAS_LOCKING_STRIPES & (KCAS_LOCKING_STRIPES-1)) == 0);
+    stripes = new kcasstripe_t[KCAS_LOCKING_STRIPES];
+    for (int i=0;i<KCAS_LOCKING_STRIPES;++i) {
+        stripes[i].version = 0;
+    }
+    kcasDescriptors = new kcasdesc_t<MAX_K>[numThreads*KCAS_SLOTS_PER_THREAD];
+    for (int i=0;i<numThreads*KCAS_SLOTS_PER_THREAD;++i) {
+        kcasDescriptors[i].numEntries = 0;
+    }
+    kcas_succeeded.init(numThreads);
+    kcas_failed.init(numThreads);
+    lock_waits.init(numThreads);
+    read_retries.init(numThreads);
+    snapshots.init(numThreads);
+    snapshot_retries.init(numThreads);
+}
+
+template <int MAX_K>
+KCASLocking<MAX_K>::~KCASLocking() {
+    delete[] stripes;
+    delete[] kcasDescriptors;
+}
+
+// returns the (even) version the stripe had when we locked it
+template <int MAX_K>
+casword_t KCASLocking<MAX_K>::lock(const int tid, const int stripe) {
+    casword_t volatile * version = &stripes[stripe].version;
+    bool waited = false;
+    int spins = 0;
+    while (1) {
+        casword_t v = *version;
+        if ((v & 1) == 0 && BOOL_CAS(version, v, v+1)) {
+            if (waited) lock_waits.inc(tid);
+            return v;
+        }
+        waited = true;
+        if (++spins == KCAS_LOCKING_SPINS_BEFORE_YIELD) {
+            spins = 0;
+            std::this_thread::yield();
+        } else {
+            __asm__ __volatile__ ("pause":::"memory");
+        }
+    }
+}
+
+// reads addr (which no kcas was writing at the time), and the version of its stripe when it was read
+template <int MAX_K>
+casword_t KCASLocking<MAX_K>::readVersioned(const int tid, casword_t volatile * addr, casword_t * version) {
+    casword_t volatile * stripeVersion = &stripes[stripeOf(addr)].version;
+    while (1) {
+        casword_t v = *stripeVersion;
+        if ((v & 1) == 0) {
+            __asm__ __volatile__ ("":::"memory"); // read the version, then the word, then the version again
+            casword_t val = *addr;
+            __asm__ __volatile__ ("":::"memory");
+            if (*stripeVersion == v) {
+                *version = v;
+                return val;
+            }
+        }
+        read_retries.inc(tid);
+        __asm__ __volatile__ ("pause":::"memory");
+    }
+}
+
+template <int MAX_K>
+bool KCASLocking<MAX_K>::kcas(const int tid, kcasptr_t ptr) {
+    // fails if the descriptor names the same word with two different expected values
+    if (!kcasdesc_sort<MAX_K>(ptr)) {
+        kcas_failed.inc(tid);
+        return false;
+    }
+    const int n = ptr->numEntries;
+
+    // the stripes to lock, in increasing order, without duplicates
+    // (sorted addresses can still map to unsorted stripes, since stripes wrap around)
+    int toLock[MAX_K];
+    casword_t oldVersions[MAX_K];
+    int numLocks = 0;
+    for (int i = 0; i < n; i++) {
+        const int s = stripeOf(ptr->entries[i].addr);
+        int j = numLocks;
+        while (j > 0 && toLock[j-1] > s) {
+            toLock[j] = toLock[j-1];
+            --j;
+        }
+        if (j > 0 && toLock[j-1] == s) { // already there: undo the shift
+            for (; j < numLocks; j++) toLock[j] = toLock[j+1];
+            continue;
+        }
+        toLock[j] = s;
+        ++numLocks;
+    }
+    for (int i = 0; i < numLocks; i++) {
+        oldVersions[i] = lock(tid, toLock[i]);
+    }
+
+    bool result = true;
+    for (int i = 0; i < n; i++) {
+        if (*ptr->entries[i].addr != ptr->entries[i].oldval) {
+            result = false;
+            break;
+        }
+    }
+    if (result) {
+        for (int i = 0; i < n; i++) {
+            if (!isCompareOnly(ptr->entries[i])) {
+                *ptr->entries[i].addr = ptr->entries[i].newval;
+            }
+        }
+    }
+
+    // unlock: a new version if we wrote anything, and the old one otherwise
+    __asm__ __volatile__ ("":::"memory");
+    for (int i = 0; i < numLocks; i++) {
+        stripes[toLock[i]].version = oldVersions[i] + (result ? 2 : 0);
+    }
+
+    if (result) kcas_succeeded.inc(tid);
+    else kcas_failed.inc(tid);
+    return result;
+}
+
+template <int MAX_K>
+casword_t KCASLocking<MAX_K>::readPtr(const int tid, casword_t volatile * addr) {
+    casword_t version;
+    return readVersioned(tid, addr, &version);
+}
+
+template <int MAX_K>
+casword_t KCASLocking<MAX_K>::readVal(const int tid, casword_t volatile * addr) {
+    return readPtr(tid, addr)>>KCAS_LEFTSHIFT;
+}
+
+/**
+ * A linearizable snapshot of n words (see kcas_double_collect), where the
+ * "raw contents" of a word is the version of its stripe. Two collects that
+ * see the same (even) versions saw no kcas write any of the words in between.
+ */
+template <int MAX_K>
+void KCASLocking<MAX_K>::readManyPtr(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out) {
+    int retries = kcas_double_collect(n, addrs, out, [this, tid](casword_t volatile * addr, casword_t * raw) {
+        return readVersioned(tid, addr, raw);
+    });
+    snapshots.inc(tid);
+    snapshot_retries.add(tid, retries);
+}
+
+template <int MAX_K>
+void KCASLocking<MAX_K>::readManyVal(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out) {
+    readManyPtr(tid, n, addrs, out);
+    for (int i = 0; i < n; i++) {
+        out[i] >>= KCAS_LEFTSHIFT;
+    }
+}
+
+template <int MAX_K>
+void KCASLocking<MAX_K>::writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval) {
+    *addr = newval;
+}
+
+template <int MAX_K>
+void KCASLocking<MAX_K>::writeInitVal(const int tid, casword_t volatile * addr, casword_t const newval) {
+    writeInitPtr(tid, addr, newval<<KCAS_LEFTSHIFT);
+}
+
+template <int MAX_K>
+kcasptr_t KCASLocking<MAX_K>::getDescriptor(const int tid, const int slot) {
+    assert(tid >= 0 && tid < numThreads);
+    assert(slot >= 0 && slot < KCAS_SLOTS_PER_THREAD);
+    kcasptr_t ptr = &kcasDescriptors[KCAS_DESC_INDEX(tid, slot)];
+    ptr->numEntries = 0;
+    return ptr;
+}
+
+template <int MAX_K>
+void KCASLocking<MAX_K>::registerMetrics(MetricsRegistry & registry) {
+    registry.addCounter("kcas_succeeded", &kcas_succeeded);
+    registry.addCounter("kcas_failed", &kcas_failed);
+    registry.addCounter("lock_waits", &lock_waits);
+    registry.addCounter("read_retries", &read_retries);
+    registry.addCounter("snapshots", &snapshots);
+    registry.addCounter("snapshot_retries", &snapshot_retries);
+}
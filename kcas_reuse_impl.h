@@ -4,12 +4,16 @@
 #include <stdint.h>
 #include <sstream>
 #include <cstring>
+#include "kcas_sort.h"
+#include "kcas_contention.h"
 using namespace std;
 
 /**
  * Note: this algorithm supports a limited number of threads (print LAST_TID to see how many).
  * It should be several thousand, at least.
  * The alg can be tweaked to support more.
+ * Descriptor tables are allocated when a provider is constructed, with one
+ * descriptor per thread that will actually use the provider (not LAST_TID).
  */
 
 #define BOOL_CAS __sync_bool_compare_and_swap
@@ -56,6 +60,22 @@ typedef intptr_t seqbits_t;
 #define TAGPTR_STATIC_DESC(id) ((tagptr_t) TAGPTR_NEW(LAST_TID-1-id, 0))
 #define TAGPTR_DUMMY_DESC(id) ((tagptr_t) TAGPTR_NEW(LAST_TID, id<<OFFSET_SEQ))
 
+/**
+ * Each thread owns KCAS_SLOTS_PER_THREAD kcas descriptors (slots), so it can
+ * have that many kcas operations prepared at once (e.g., to batch them, or
+ * because it runs several tasks that each prepare their own). A kcas tagptr
+ * identifies a descriptor rather than a thread: its tid field holds the
+ * owner's tid followed by KCAS_SLOT_BITS slot bits (so the slot bits take
+ * tid bits, and numThreads * KCAS_SLOTS_PER_THREAD must be below LAST_TID-1).
+ * rdcss descriptors are only used inside a kcas, so there is one per thread.
+ */
+#ifndef KCAS_SLOT_BITS
+#define KCAS_SLOT_BITS 2
+#endif
+#define KCAS_SLOTS_PER_THREAD (1<<KCAS_SLOT_BITS)
+#define KCAS_DESC_INDEX(tid, slot) (((tid)<<KCAS_SLOT_BITS) | (slot))
+#define KCAS_DESC_OWNER(index) ((index)>>KCAS_SLOT_BITS)
+
 #define comma ,
 
 #define SEQBITS_UNPACK_FIELD(seqBits, mask, offset) \
@@ -109,6 +129,20 @@ typedef intptr_t seqbits_t;
     __asm__ __volatile__ ("":::"memory"); /* prevent compiler from reordering read of __src->seqBits before (at least the reading portion of) the memcpy */ \
     (UNPACK_SEQ(__src->seqBits) == UNPACK_SEQ((tagptr))); \
 })
+// like DESC_SNAPSHOT, for a kcas descriptor (seqBits, numEntries, entries[]),
+// but only copies the entries that are in use. numEntries is read racily,
+// so it is clamped to the size of entries[] (a torn copy fails the seq# check anyway).
+#define KCASDESC_SNAPSHOT(descType, descArray, descDest, tagptr) ({ \
+    descType *__src = TAGPTR_UNPACK_PTR((descArray), (tagptr)); \
+    const casword_t __max = sizeof(__src->entries)/sizeof(__src->entries[0]); \
+    (descDest)->seqBits = __src->seqBits; \
+    casword_t __n = __src->numEntries; \
+    if (__n > __max) __n = __max; \
+    (descDest)->numEntries = __n; \
+    memcpy((descDest)->entries, (void *) __src->entries, __n*sizeof(__src->entries[0])); \
+    __asm__ __volatile__ ("":::"memory"); \
+    (UNPACK_SEQ(__src->seqBits) == UNPACK_SEQ((tagptr))); \
+})
 #define DESC_READ_FIELD(successBit, fldSeqBits, tagptr, mask, offset) ({ \
     seqbits_t __seqBits = (fldSeqBits); \
     successBit = (__seqBits & MASK_SEQ) == ((tagptr) & MASK_SEQ); \
@@ -122,8 +156,8 @@ typedef intptr_t seqbits_t;
 #define DESC_INITIALIZED(descArray, tid) \
     (descArray)[(tid)].seqBits += (1<<OFFSET_SEQ);
 
-#define DESC_INIT_ALL(descArray, macro_seqBitsNew) { \
-    for (int i=0;i<(LAST_TID-1);++i) { \
+#define DESC_INIT_ALL(descArray, macro_seqBitsNew, numDescs) { \
+    for (int i=0;i<(numDescs);++i) { \
         (descArray)[i].seqBits = macro_seqBitsNew(0); \
     } \
 }
@@ -146,9 +180,21 @@ typedef intptr_t seqbits_t;
 #define KCAS_STATE_UNDECIDED 0
 #define KCAS_STATE_SUCCEEDED 4
 #define KCAS_STATE_FAILED 8
+#define KCAS_STATE_RETRY 12 // failed, but only because of a conflict on a compare-only word (see validateCompares)
 
 #define KCAS_LEFTSHIFT 2
 
+// the newval of a compare-only entry. it has both tag bits set,
+// so it can't be a value (or a pointer) that anyone wants to write.
+#define KCAS_COMPARE_ONLY ((casword_t) (RDCSS_TAGBIT | KCAS_TAGBIT))
+
+/**
+ * Descriptors start on a cache line (so they don't falsely share with one
+ * another) and are not padded beyond that, to keep descriptor tables compact.
+ * The hot fields (seqBits, and numEntries for kcas descriptors) come first,
+ * so reading a descriptor's state touches only its first cache line, and
+ * so does a whole kcas descriptor with at most two entries.
+ */
 struct rdcssdesc_t {
     volatile seqbits_t seqBits;
     casword_t volatile * addr1;
@@ -157,8 +203,7 @@ struct rdcssdesc_t {
     casword_t old2;
     casword_t new2;
     const static int size = sizeof(seqBits)+sizeof(addr1)+sizeof(old1)+sizeof(addr2)+sizeof(old2)+sizeof(new2);
-    volatile char padding[128+((64-size%64)%64)]; // add padding to prevent false sharing
-};
+} __attribute__ ((aligned(64)));
 
 struct kcasentry_t { // just part of kcasdesc_t, not a standalone descriptor
     casword_t volatile * addr;
@@ -173,7 +218,6 @@ public:
     casword_t numEntries;
     kcasentry_t entries[MAX_K];
     const static int size = sizeof(seqBits)+sizeof(numEntries)+sizeof(entries);
-    volatile char padding[128+((64-size%64)%64)]; // add padding to prevent false sharing
     
     void addValAddr(casword_t * addr, casword_t oldval, casword_t newval) {
         entries[numEntries].addr = addr;
@@ -190,10 +234,102 @@ public:
         ++numEntries;
         assert(numEntries <= MAX_K);
     }
+
+    // compare-only entries: the kcas only succeeds if addr contains val,
+    // but (depending on the provider) addr is not locked or written.
+    // (their newval is KCAS_COMPARE_ONLY. an entry that writes back the
+    //  value it expects is a normal entry, and is locked like any other.)
+    void addValCompare(casword_t * addr, casword_t val) {
+        addPtrCompare(addr, val << KCAS_LEFTSHIFT);
+    }
+
+    void addPtrCompare(casword_t * addr, casword_t val) {
+        entries[numEntries].addr = addr;
+        entries[numEntries].oldval = val;
+        entries[numEntries].newval = KCAS_COMPARE_ONLY;
+        ++numEntries;
+        assert(numEntries <= MAX_K);
+    }
+} __attribute__ ((aligned(64)));
+
+static bool isCompareOnly(const kcasentry_t & entry) {
+    return entry.newval == KCAS_COMPARE_ONLY;
+}
+
+// the value of entry's word once its kcas is decided (and has succeeded or not)
+static casword_t decidedValue(const kcasentry_t & entry, bool succeeded) {
+    return (succeeded && !isCompareOnly(entry)) ? entry.newval : entry.oldval;
+}
+
+/**
+ * Write clocks, which let a snapshot see that a plain word was written between
+ * two collects even if it was changed back (see kcas_double_collect).
+ * Words are mapped to a fixed table of clocks by address.
+ * Every write that changes a word's value adds KCAS_CLOCK_WRITE to its clock,
+ * at a moment when the word can't change without the clock showing it:
+ * - a kcas that locks its words with its descriptor ticks the clocks of the
+ *   words it writes once they are all locked, just before it is decided
+ *   SUCCEEDED (by whoever decides it, so the words still hold the descriptor);
+ * - a CAS that doesn't lock the word first (a 1-word kcas) adds 1 before the
+ *   CAS, and the rest of KCAS_CLOCK_WRITE after it (or takes the 1 back if it
+ *   failed). The low bits count these CASes while they are in progress.
+ *   A reader that sees any of them can't tell if the word has changed, so a
+ *   snapshot retries until they are done (double collect was never
+ *   lock-free for readers anyway: any write makes it retry);
+ * - a transaction (KCASHybrid) ticks the clocks of its words inside it.
+ */
+#ifndef KCAS_CLOCKS
+#define KCAS_CLOCKS 4096                            // must be a power of two
+#endif
+#define KCAS_CLOCK_WRITE (((casword_t) 1)<<16)      // (below it: CASes in progress)
+
+struct kcasclock_t {
+    volatile casword_t ticks;
+    volatile char padding[PADDING_BYTES-sizeof(casword_t)];
 };
 
-template <int MAX_K>
+static kcasclock_t * kcas_clocks_new() {
+    assert((KCAS_CLOCKS & (KCAS_CLOCKS-1)) == 0);
+    kcasclock_t * clocks = new kcasclock_t[KCAS_CLOCKS];
+    for (int i=0;i<KCAS_CLOCKS;++i) {
+        clocks[i].ticks = 0;
+    }
+    return clocks;
+}
+
+template <class Word>
+static casword_t volatile * kcas_clock_of(kcasclock_t * clocks, Word volatile * addr) {
+    return &clocks[(((uintptr_t) addr) / sizeof(Word)) & (KCAS_CLOCKS-1)].ticks;
+}
+
+static bool kcas_clock_busy(casword_t ticks) {
+    return (ticks & (KCAS_CLOCK_WRITE-1));
+}
+
+// run cas() (which returns true if it wrote the word) on a word whose clock is clock
+template <class CASFunc>
+static bool kcas_clocked_cas(casword_t volatile * clock, CASFunc cas) {
+    __sync_fetch_and_add(clock, 1);
+    const bool result = cas();
+    __sync_fetch_and_add(clock, result ? KCAS_CLOCK_WRITE-1 : (casword_t) -1);
+    return result;
+}
+
+// tick the clocks of the words a kcas writes (which it has locked, and is about to decide SUCCEEDED)
+template <class Desc>
+static void kcas_tick_clocks(kcasclock_t * clocks, Desc * desc) {
+    for (int i = 0; i < desc->numEntries; i++) {
+        if (!isCompareOnly(desc->entries[i])) {
+            __sync_fetch_and_add(kcas_clock_of(clocks, desc->entries[i].addr), KCAS_CLOCK_WRITE);
+        }
+    }
+}
+
+template <int MAX_K, class ContentionPolicy = KCASHelpImmediately>
 class KCASLockFree {
+public:
+    typedef casword_t word_t; // the type of a word that kcas operates on
+
     /**
      * Data definitions
      */
@@ -207,28 +343,58 @@ private:
     #define RDCSS_SEQBITS_NEW(seqBits) \
         (((seqBits)&MASK_SEQ)+(1<<OFFSET_SEQ))
     volatile char __padding_desc[128];
-    kcasdesc_t<MAX_K> kcasDescriptors[LAST_TID+1] __attribute__ ((aligned(64)));
-    rdcssdesc_t rdcssDescriptors[LAST_TID+1] __attribute__ ((aligned(64)));
+    const int numThreads;       // tids are in [0, numThreads)
+    kcasdesc_t<MAX_K> * kcasDescriptors; // KCAS_SLOTS_PER_THREAD per thread (see KCAS_DESC_INDEX)
+    rdcssdesc_t * rdcssDescriptors;      // one per thread
+    kcasclock_t * clocks;                // KCAS_CLOCKS of them (see kcasclock_t)
     volatile char __padding_desc3[128];
+    StatCounter kcas_succeeded;
+    StatCounter kcas_failed;
+    StatCounter kcas_helped;    // descriptors of other threads we helped (from our own kcas or from a read)
+    StatCounter snapshots;      // readMany calls
+    StatCounter snapshot_retries; // extra collects readMany needed because words changed
+    StatCounter rdcss_helped;   // rdcss descriptors of other threads we helped
+    StatCounter rdcss_retries;  // times our rdcss found another rdcss in the word and had to retry
+    StatCounter entry_retries;  // times we had to retry locking an entry (after helping or backing off)
+    StatCounter stale_kcas_snapshots;  // kcas descriptors that were reused before we could help them
+    StatCounter stale_rdcss_snapshots; // rdcss descriptors that were reused before we could help them
+    StatCounter locked_before_failure; // entries the owner of a failed kcas had locked when it decided to fail
+    StatCounter kcas_retries;   // times our kcas had to retry because of an undecided kcas in a compare-only word
+    StatCounter forced_retries; // undecided kcas operations in our compare-only words that we made retry
+    StatCounter conflicts;      // times we ran into another thread's kcas descriptor
+    StatCounter conflicts_waited_out; // ... and it was gone after backing off, so we didn't help
+    StatCounter backoff_rounds; // rounds of backoff done because of conflicts
+    volatile char __padding_desc4[128];
 
     /**
      * Function declarations
      */
 public:
-    KCASLockFree();
+    KCASLockFree(const int _numThreads = MAX_THREADS);
+    ~KCASLockFree();
     void writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval);
     void writeInitVal(const int tid, casword_t volatile * addr, casword_t const newval);
     casword_t readPtr(const int tid, casword_t volatile * addr);
     casword_t readVal(const int tid, casword_t volatile * addr);
+    void readManyPtr(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out);
+    void readManyVal(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out);
     bool kcas(const int tid, kcasptr_t ptr);
-    kcasptr_t getDescriptor(const int tid);
+    kcasptr_t getDescriptor(const int tid, const int slot = 0);
+    void registerMetrics(MetricsRegistry & registry);
+    // (for KCASHybrid, whose transactions write words without us)
+    casword_t volatile * clockOf(casword_t volatile * addr) { return kcas_clock_of(clocks, addr); }
 private:
-    bool help(const int tid, kcastagptr_t tagptr, kcasptr_t ptr, bool helpingOther);
+    bool kcas1(const int tid, kcasptr_t ptr);
+    int kcas2(const int tid, kcastagptr_t tagptr, kcasptr_t ptr);
+    bool readCompareOnly(const int tid, kcastagptr_t tagptr, casword_t volatile * addr, casword_t * value, casword_t * raw);
+    int validateCompares(const int tid, kcastagptr_t tagptr, kcasptr_t snapshot);
+    int help(const int tid, kcastagptr_t tagptr, kcasptr_t ptr, bool helpingOther);
     void helpOther(const int tid, kcastagptr_t tagptr);
+    void resolveConflict(const int tid, casword_t volatile * addr, kcastagptr_t tagptr);
     casword_t rdcssRead(const int tid, casword_t volatile * addr);
     casword_t rdcss(const int tid, rdcssptr_t ptr, rdcsstagptr_t tagptr);
     void rdcssHelp(rdcsstagptr_t tagptr, rdcssptr_t snapshot, bool helpingOther);
-    void rdcssHelpOther(rdcsstagptr_t tagptr);
+    void rdcssHelpOther(const int tid, rdcsstagptr_t tagptr);
 };
 
 static bool isRdcss(casword_t val) {
@@ -239,8 +405,63 @@ static bool isKcas(casword_t val) {
     return (val & KCAS_TAGBIT);
 }
 
-template <int MAX_K>
-void KCASLockFree<MAX_K>::rdcssHelp(rdcsstagptr_t tagptr, rdcssptr_t snapshot, bool helpingOther) {
+/**
+ * Snapshot n words by double collect: collect them until a collect sees
+ * exactly the same as the previous one, so no word was written between those
+ * two collects, and there was a moment between them when every word held the
+ * value we return for it.
+ * read(addr, &raw) must return the value of addr (without waiting for anyone)
+ * and the raw contents of addr. A word that contains a tagged pointer is
+ * known not to have changed if it contains the same tagged pointer and has
+ * the same value (sequence numbers make the tagged pointer unique).
+ * A plain value can change and change back, so clock(addr) must return the
+ * ticks of addr's write clock (see kcasclock_t). We read it before the word,
+ * and again after the word in the next collect: if no CAS was in progress the
+ * first time and the ticks are the same, nothing wrote the word in between.
+ * (Without clock, raw must change whenever the word is written, as the
+ * stripe versions of KCASLocking do.)
+ * Returns the number of collects that weren't needed in the best case.
+ */
+template <class Addr, class ReadFunc, class ClockFunc>
+static int kcas_double_collect(const int n, Addr const * addrs, casword_t * out, ReadFunc read, ClockFunc clock) {
+    const int STACK_WORDS = 64;
+    casword_t rawOnStack[STACK_WORDS];
+    casword_t ticksOnStack[STACK_WORDS];
+    casword_t * raw = (n <= STACK_WORDS) ? rawOnStack : new casword_t[n];
+    casword_t * ticks = (n <= STACK_WORDS) ? ticksOnStack : new casword_t[n];
+    for (int i = 0; i < n; i++) {
+        ticks[i] = clock(addrs[i]);
+        out[i] = read(addrs[i], &raw[i]);
+    }
+    int retries = 0;
+    while (1) {
+        bool changed = false;
+        for (int i = 0; i < n; i++) {
+            casword_t r;
+            const casword_t before = clock(addrs[i]);
+            casword_t val = read(addrs[i], &r);
+            if (r != raw[i] || val != out[i] || clock(addrs[i]) != ticks[i] || kcas_clock_busy(ticks[i])) {
+                changed = true;
+                raw[i] = r;
+                out[i] = val;
+            }
+            ticks[i] = before;
+        }
+        if (!changed) break;
+        ++retries;
+    }
+    if (raw != rawOnStack) delete[] raw;
+    if (ticks != ticksOnStack) delete[] ticks;
+    return retries;
+}
+
+template <class Addr, class ReadFunc>
+static int kcas_double_collect(const int n, Addr const * addrs, casword_t * out, ReadFunc read) {
+    return kcas_double_collect(n, addrs, out, read, [](Addr addr) { return (casword_t) 0; });
+}
+
+template <int MAX_K, class ContentionPolicy>
+void KCASLockFree<MAX_K, ContentionPolicy>::rdcssHelp(rdcsstagptr_t tagptr, rdcssptr_t snapshot, bool helpingOther) {
     bool readSuccess;
     casword_t v = DESC_READ_FIELD(readSuccess, *snapshot->addr1, snapshot->old1, KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
     if (!readSuccess) v = KCAS_STATE_SUCCEEDED; // return;
@@ -253,58 +474,111 @@ void KCASLockFree<MAX_K>::rdcssHelp(rdcsstagptr_t tagptr, rdcssptr_t snapshot, b
     }
 }
 
-template <int MAX_K>
-void KCASLockFree<MAX_K>::rdcssHelpOther(rdcsstagptr_t tagptr) {
+template <int MAX_K, class ContentionPolicy>
+void KCASLockFree<MAX_K, ContentionPolicy>::rdcssHelpOther(const int tid, rdcsstagptr_t tagptr) {
     rdcssdesc_t newSnapshot;
     const int sz = rdcssdesc_t::size;
+    rdcss_helped.inc(tid);
     if (DESC_SNAPSHOT(rdcssdesc_t, rdcssDescriptors, &newSnapshot, tagptr, sz)) {
         rdcssHelp(tagptr, &newSnapshot, true);
+    } else {
+        stale_rdcss_snapshots.inc(tid);
     }
 }
 
-template <int MAX_K>
-casword_t KCASLockFree<MAX_K>::rdcss(const int tid, rdcssptr_t ptr, rdcsstagptr_t tagptr) {
+template <int MAX_K, class ContentionPolicy>
+casword_t KCASLockFree<MAX_K, ContentionPolicy>::rdcss(const int tid, rdcssptr_t ptr, rdcsstagptr_t tagptr) {
     casword_t r;
     do {
         r = VAL_CAS(ptr->addr2, ptr->old2, (casword_t) tagptr);
         if (isRdcss(r)) {
-            rdcssHelpOther((rdcsstagptr_t) r);
+            rdcss_retries.inc(tid);
+            rdcssHelpOther(tid, (rdcsstagptr_t) r);
         }
     } while (isRdcss(r));
     if (r == ptr->old2) rdcssHelp(tagptr, ptr, false); // finish our own operation
     return r;
 }
 
-template <int MAX_K>
-casword_t KCASLockFree<MAX_K>::rdcssRead(const int tid, casword_t volatile * addr) {
+template <int MAX_K, class ContentionPolicy>
+casword_t KCASLockFree<MAX_K, ContentionPolicy>::rdcssRead(const int tid, casword_t volatile * addr) {
     casword_t r;
     do {
         r = *addr;
         if (isRdcss(r)) {
-            rdcssHelpOther((rdcsstagptr_t) r);
+            rdcssHelpOther(tid, (rdcsstagptr_t) r);
         }
     } while (isRdcss(r));
     return r;
 }
 
-template <int MAX_K>
-KCASLockFree<MAX_K>::KCASLockFree() {
-    DESC_INIT_ALL(kcasDescriptors, KCAS_SEQBITS_NEW);
-    DESC_INIT_ALL(rdcssDescriptors, RDCSS_SEQBITS_NEW);
+template <int MAX_K, class ContentionPolicy>
+KCASLockFree<MAX_K, ContentionPolicy>::KCASLockFree(const int _numThreads) : numThreads(_numThreads) {
+    // the last descriptor indexes are reserved (see TAGPTR_STATIC_DESC)
+    assert(numThreads > 0 && numThreads*KCAS_SLOTS_PER_THREAD < LAST_TID-1);
+    kcasDescriptors = new kcasdesc_t<MAX_K>[numThreads*KCAS_SLOTS_PER_THREAD];
+    rdcssDescriptors = new rdcssdesc_t[numThreads];
+    DESC_INIT_ALL(kcasDescriptors, KCAS_SEQBITS_NEW, numThreads*KCAS_SLOTS_PER_THREAD);
+    DESC_INIT_ALL(rdcssDescriptors, RDCSS_SEQBITS_NEW, numThreads);
+    clocks = kcas_clocks_new();
+    kcas_succeeded.init(numThreads);
+    kcas_failed.init(numThreads);
+    kcas_helped.init(numThreads);
+    snapshots.init(numThreads);
+    snapshot_retries.init(numThreads);
+    rdcss_helped.init(numThreads);
+    rdcss_retries.init(numThreads);
+    entry_retries.init(numThreads);
+    stale_kcas_snapshots.init(numThreads);
+    stale_rdcss_snapshots.init(numThreads);
+    locked_before_failure.init(numThreads);
+    kcas_retries.init(numThreads);
+    forced_retries.init(numThreads);
+    conflicts.init(numThreads);
+    conflicts_waited_out.init(numThreads);
+    backoff_rounds.init(numThreads);
 }
 
-template <int MAX_K>
-void KCASLockFree<MAX_K>::helpOther(const int tid, kcastagptr_t tagptr) {
+template <int MAX_K, class ContentionPolicy>
+KCASLockFree<MAX_K, ContentionPolicy>::~KCASLockFree() {
+    delete[] kcasDescriptors;
+    delete[] rdcssDescriptors;
+    delete[] clocks;
+}
+
+template <int MAX_K, class ContentionPolicy>
+void KCASLockFree<MAX_K, ContentionPolicy>::helpOther(const int tid, kcastagptr_t tagptr) {
     kcasdesc_t<MAX_K> newSnapshot;
-    const int sz = kcasdesc_t<MAX_K>::size;
-    //cout<<"size of kcas descriptor is "<<sizeof(kcasdesc_t<MAX_K>)<<" and sz="<<sz<<endl;
-    if (DESC_SNAPSHOT(kcasdesc_t<MAX_K>, kcasDescriptors, &newSnapshot, tagptr, sz)) {
+    kcas_helped.inc(tid);
+    if (KCASDESC_SNAPSHOT(kcasdesc_t<MAX_K>, kcasDescriptors, &newSnapshot, tagptr)) {
         help(tid, tagptr, &newSnapshot, true);
+    } else {
+        stale_kcas_snapshots.inc(tid);
     }
 }
 
-template <int MAX_K>
-bool KCASLockFree<MAX_K>::help(const int tid, kcastagptr_t tagptr, kcasptr_t snapshot, bool helpingOther) {
+/**
+ * We found tagptr (another thread's kcas) in addr. Depending on the contention
+ * policy, back off until it is gone (and return), or help it.
+ */
+template <int MAX_K, class ContentionPolicy>
+void KCASLockFree<MAX_K, ContentionPolicy>::resolveConflict(const int tid, casword_t volatile * addr, kcastagptr_t tagptr) {
+    conflicts.inc(tid);
+    const int rounds = ContentionPolicy::backoffRounds(tid, KCAS_DESC_OWNER(TAGPTR_UNPACK_TID(tagptr)));
+    for (int round = 0; round < rounds; ++round) {
+        kcas_backoff_spin(round);
+        backoff_rounds.inc(tid);
+        if (*addr != (casword_t) tagptr) {
+            conflicts_waited_out.inc(tid);
+            return;
+        }
+    }
+    helpOther(tid, tagptr);
+}
+
+// returns the state the kcas was decided with (or FAILED, if our snapshot of it is stale)
+template <int MAX_K, class ContentionPolicy>
+int KCASLockFree<MAX_K, ContentionPolicy>::help(const int tid, kcastagptr_t tagptr, kcasptr_t snapshot, bool helpingOther) {
     // phase 1: "locking" addresses for this kcas
     int newstate;
     
@@ -314,30 +588,51 @@ bool KCASLockFree<MAX_K>::help(const int tid, kcastagptr_t tagptr, kcasptr_t sna
     int state = DESC_READ_FIELD(successBit, ptr->seqBits, tagptr, KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
     if (!successBit) {
         assert(helpingOther);
-        return false;
+        stale_kcas_snapshots.inc(tid);
+        return KCAS_STATE_FAILED;
     }
     
     if (state == KCAS_STATE_UNDECIDED) {
         newstate = KCAS_STATE_SUCCEEDED;
+        // (over all entries: helpers skip entry 0, which may be compare-only)
+        bool hasCompares = false;
+        for (int i = 0; i < snapshot->numEntries; i++) {
+            if (isCompareOnly(snapshot->entries[i])) hasCompares = true;
+        }
+        int locked = 0;
         for (int i = helpingOther; i < snapshot->numEntries; i++) {
+            if (isCompareOnly(snapshot->entries[i])) continue; // validated below, once everything else is locked
 retry_entry:
-            // prepare rdcss descriptor and run rdcss
-            rdcssdesc_t *rdcssptr = DESC_NEW(rdcssDescriptors, RDCSS_SEQBITS_NEW, tid);
-            rdcssptr->addr1 = (casword_t*) &ptr->seqBits;
-            rdcssptr->old1 = tagptr; // pass the sequence number (as part of tagptr)
-            rdcssptr->old2 = snapshot->entries[i].oldval;
-            rdcssptr->addr2 = snapshot->entries[i].addr; // p stopped here (step 2)
-            rdcssptr->new2 = (casword_t) tagptr;
-            DESC_INITIALIZED(rdcssDescriptors, tid);
-            
             casword_t val;
-            val = rdcss(tid, rdcssptr, TAGPTR_NEW(tid, rdcssptr->seqBits, RDCSS_TAGBIT));
+            if (i == 0) {
+                // only the owner locks the first address (helpers start at 1),
+                // and nobody can find our descriptor until it is locked,
+                // so nobody can have decided it yet: a plain CAS is as good as an rdcss
+                val = VAL_CAS(snapshot->entries[0].addr, snapshot->entries[0].oldval, (casword_t) tagptr);
+                if (isRdcss(val)) {
+                    rdcssHelpOther(tid, (rdcsstagptr_t) val);
+                    entry_retries.inc(tid);
+                    goto retry_entry;
+                }
+            } else {
+                // prepare rdcss descriptor and run rdcss
+                rdcssdesc_t *rdcssptr = DESC_NEW(rdcssDescriptors, RDCSS_SEQBITS_NEW, tid);
+                rdcssptr->addr1 = (casword_t*) &ptr->seqBits;
+                rdcssptr->old1 = tagptr; // pass the sequence number (as part of tagptr)
+                rdcssptr->old2 = snapshot->entries[i].oldval;
+                rdcssptr->addr2 = snapshot->entries[i].addr; // p stopped here (step 2)
+                rdcssptr->new2 = (casword_t) tagptr;
+                DESC_INITIALIZED(rdcssDescriptors, tid);
+
+                val = rdcss(tid, rdcssptr, TAGPTR_NEW(tid, rdcssptr->seqBits, RDCSS_TAGBIT));
+            }
             
             // check for failure of rdcss and handle it
             if (isKcas(val)) {
                 // if rdcss failed because of a /different/ kcas, we help it
                 if (val != (casword_t) tagptr) {
-                    helpOther(tid, (kcastagptr_t) val);
+                    resolveConflict(tid, snapshot->entries[i].addr, (kcastagptr_t) val);
+                    entry_retries.inc(tid);
                     goto retry_entry;
                 }
             } else {
@@ -346,83 +641,332 @@ retry_entry:
                     break;
                 }
             }
+            ++locked;
+        }
+        if (hasCompares && newstate == KCAS_STATE_SUCCEEDED) {
+            newstate = validateCompares(tid, tagptr, snapshot);
         }
+        if (newstate == KCAS_STATE_SUCCEEDED) kcas_tick_clocks(clocks, snapshot);
         SEQBITS_CAS_FIELD(successBit
                 , ptr->seqBits, snapshot->seqBits
                 , KCAS_STATE_UNDECIDED, newstate
                 , KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
+        // only count it if it was our own kcas, and our decision is the one that stuck
+        if (!helpingOther && successBit && newstate == KCAS_STATE_FAILED) {
+            locked_before_failure.add(tid, locked);
+        }
     }
 
     // phase 2 (all addresses are now "locked" for this kcas)
     state = DESC_READ_FIELD(successBit, ptr->seqBits, tagptr, KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
-    if (!successBit) return false;
+    if (!successBit) return KCAS_STATE_FAILED;
 
     bool succeeded = (state == KCAS_STATE_SUCCEEDED);
     for (int i = 0; i < snapshot->numEntries; i++) {
-        casword_t newval = succeeded ? snapshot->entries[i].newval : snapshot->entries[i].oldval;
-        BOOL_CAS(snapshot->entries[i].addr, (casword_t) tagptr, newval);
+        if (isCompareOnly(snapshot->entries[i])) continue;
+        BOOL_CAS(snapshot->entries[i].addr, (casword_t) tagptr, decidedValue(snapshot->entries[i], succeeded));
     }
-    return succeeded;
+    return state;
 }
 
-// TODO: replace crappy bubblesort with something fast for large MAX_K (maybe even use insertion sort for small MAX_K)
-template <int MAX_K>
-static void kcasdesc_sort(kcasptr_t ptr) {
-    kcasentry_t temp;
-    for (int i = 0; i < ptr->numEntries; i++) {
-        for (int j = 0; j < ptr->numEntries - i - 1; j++) {
-            if (ptr->entries[j].addr > ptr->entries[j + 1].addr) {
-                temp = ptr->entries[j];
-                ptr->entries[j] = ptr->entries[j + 1];
-                ptr->entries[j + 1] = temp;
-            }
+/**
+ * Read the value of a compare-only word of the kcas tagptr, whose other words
+ * it has locked. Also returns the raw contents of the word.
+ *
+ * If another kcas that is still undecided has locked the word, we can't use
+ * its oldval: it may go on to succeed, and its own compare-only words may be
+ * words we have locked (so each kcas would have validated against the other's
+ * old values, and there is no order in which they could both have happened).
+ * We can't help it either, since it may be trying to lock a word we hold.
+ * So the kcas with the lower descriptor index goes first: if that's us, we
+ * make the other one retry (after which the word has its old value),
+ * and otherwise we return false, and our kcas has to retry.
+ */
+template <int MAX_K, class ContentionPolicy>
+bool KCASLockFree<MAX_K, ContentionPolicy>::readCompareOnly(const int tid, kcastagptr_t tagptr, casword_t volatile * addr, casword_t * value, casword_t * raw) {
+    kcasptr_t ours = TAGPTR_UNPACK_PTR(kcasDescriptors, tagptr);
+    while (1) {
+        casword_t r = rdcssRead(tid, addr);
+        *raw = r;
+        if (!isKcas(r)) {
+            *value = r;
+            return true;
         }
+
+        kcasptr_t ptr = TAGPTR_UNPACK_PTR(kcasDescriptors, r);
+        bool successBit;
+        int state = DESC_READ_FIELD(successBit, ptr->seqBits, r, KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
+        if (!successBit) continue;
+        if (state == KCAS_STATE_UNDECIDED) {
+            // (if our kcas has been decided, it doesn't matter what we return)
+            if ((ours->seqBits & (MASK_SEQ | KCAS_SEQBITS_MASK_STATE)) != (tagptr & MASK_SEQ)) return false;
+            if (TAGPTR_UNPACK_TID(r) < TAGPTR_UNPACK_TID(tagptr)) return false;
+            SEQBITS_CAS_FIELD(successBit
+                    , ptr->seqBits, r
+                    , KCAS_STATE_UNDECIDED, KCAS_STATE_RETRY
+                    , KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
+            if (successBit) forced_retries.inc(tid);
+            continue;
+        }
+        __asm__ __volatile__ ("":::"memory");
+        const int n = ptr->numEntries;
+        int i = 0;
+        while (i < n && ptr->entries[i].addr != addr) ++i;
+        if (i == n) continue;
+        *value = decidedValue(ptr->entries[i], state == KCAS_STATE_SUCCEEDED);
+        __asm__ __volatile__ ("":::"memory");
+        if ((ptr->seqBits & MASK_SEQ) == (r & MASK_SEQ)) return true;
     }
 }
 
-template <int MAX_K>
-bool KCASLockFree<MAX_K>::kcas(const int tid, kcasptr_t ptr) {
-    // sort entries in the kcas descriptor to guarantee progress
-    kcasdesc_sort<MAX_K>(ptr);
-    DESC_INITIALIZED(kcasDescriptors, tid);
-    kcastagptr_t tagptr = TAGPTR_NEW(tid, ptr->seqBits, KCAS_TAGBIT);
-
-    // perform the kcas and retire the old descriptor
-    bool result = help(tid, tagptr, ptr, false);
+/**
+ * Check the compare-only entries of the kcas tagptr, whose other entries are
+ * all locked, and return the state it should be decided with.
+ * We collect the compare-only words until two collects in a row see exactly
+ * the same contents and clocks (as in kcas_double_collect), so there was a
+ * moment between them when every one of them held its expected value (and the
+ * locked words can't change until the kcas is decided).
+ * If one of them is locked by a kcas that goes first (see readCompareOnly),
+ * we can't tell, so the kcas is decided RETRY.
+ */
+template <int MAX_K, class ContentionPolicy>
+int KCASLockFree<MAX_K, ContentionPolicy>::validateCompares(const int tid, kcastagptr_t tagptr, kcasptr_t snapshot) {
+    casword_t raw[MAX_K];
+    casword_t ticks[MAX_K];
+    bool first = true;
+    while (1) {
+        bool changed = false;
+        for (int i = 0; i < snapshot->numEntries; i++) {
+            if (!isCompareOnly(snapshot->entries[i])) continue;
+            casword_t volatile * clock = kcas_clock_of(clocks, snapshot->entries[i].addr);
+            const casword_t before = *clock;
+            casword_t r, val;
+            if (!readCompareOnly(tid, tagptr, snapshot->entries[i].addr, &val, &r)) return KCAS_STATE_RETRY;
+            if (val != snapshot->entries[i].oldval) return KCAS_STATE_FAILED;
+            if (!first && (r != raw[i] || *clock != ticks[i] || kcas_clock_busy(ticks[i]))) changed = true;
+            raw[i] = r;
+            ticks[i] = before;
+        }
+        if (!first && !changed) return KCAS_STATE_SUCCEEDED;
+        first = false;
+    }
+}
+
+// a 1-word kcas is just a CAS (that helps whatever descriptor is in its way, and ticks the word's clock)
+template <int MAX_K, class ContentionPolicy>
+bool KCASLockFree<MAX_K, ContentionPolicy>::kcas1(const int tid, kcasptr_t ptr) {
+    if (isCompareOnly(ptr->entries[0])) {
+        return readPtr(tid, ptr->entries[0].addr) == ptr->entries[0].oldval;
+    }
+    casword_t volatile * clock = kcas_clock_of(clocks, ptr->entries[0].addr);
+    while (1) {
+        casword_t val;
+        if (kcas_clocked_cas(clock, [&]() {
+            return (val = VAL_CAS(ptr->entries[0].addr, ptr->entries[0].oldval, ptr->entries[0].newval)) == ptr->entries[0].oldval;
+        })) return true;
+        if (isRdcss(val)) rdcssHelpOther(tid, (rdcsstagptr_t) val);
+        else if (isKcas(val)) resolveConflict(tid, ptr->entries[0].addr, (kcastagptr_t) val);
+        else return false;
+    }
+}
+
+/**
+ * A 2-word kcas, for its owner (helpers use help() as usual): help() without
+ * the loops and the snapshot. A CAS locks the word we write first (nobody can
+ * find our descriptor before that, so it needn't be an rdcss), a single rdcss
+ * locks the other word, or a single read validates it if it is compare-only
+ * (one word needs no double collect), and then we decide.
+ * The entries must be sorted, and be for different words.
+ * Returns the state the kcas was decided with.
+ */
+template <int MAX_K, class ContentionPolicy>
+int KCASLockFree<MAX_K, ContentionPolicy>::kcas2(const int tid, kcastagptr_t tagptr, kcasptr_t ptr) {
+    kcasentry_t * first = &ptr->entries[0];
+    kcasentry_t * second = &ptr->entries[1];
+    if (isCompareOnly(*first)) {
+        if (isCompareOnly(*second)) return help(tid, tagptr, ptr, false); // nothing to lock
+        std::swap(first, second); // lock the word we write, then validate the other
+    }
+
+    casword_t val;
+    while ((val = VAL_CAS(first->addr, first->oldval, (casword_t) tagptr)) != first->oldval) {
+        if (isRdcss(val)) rdcssHelpOther(tid, (rdcsstagptr_t) val);
+        else if (isKcas(val)) resolveConflict(tid, first->addr, (kcastagptr_t) val);
+        else return KCAS_STATE_FAILED; // nothing is locked, and nobody has seen our descriptor
+        entry_retries.inc(tid);
+    }
+
+    int newstate;
+    if (isCompareOnly(*second)) {
+        casword_t raw;
+        if (!readCompareOnly(tid, tagptr, second->addr, &val, &raw)) newstate = KCAS_STATE_RETRY;
+        else newstate = (val == second->oldval) ? KCAS_STATE_SUCCEEDED : KCAS_STATE_FAILED;
+    } else {
+        while (1) {
+            rdcssdesc_t *rdcssptr = DESC_NEW(rdcssDescriptors, RDCSS_SEQBITS_NEW, tid);
+            rdcssptr->addr1 = (casword_t*) &ptr->seqBits;
+            rdcssptr->old1 = tagptr;
+            rdcssptr->old2 = second->oldval;
+            rdcssptr->addr2 = second->addr;
+            rdcssptr->new2 = (casword_t) tagptr;
+            DESC_INITIALIZED(rdcssDescriptors, tid);
+            val = rdcss(tid, rdcssptr, TAGPTR_NEW(tid, rdcssptr->seqBits, RDCSS_TAGBIT));
+            if (!isKcas(val) || val == (casword_t) tagptr) break;
+            resolveConflict(tid, second->addr, (kcastagptr_t) val);
+            entry_retries.inc(tid);
+        }
+        newstate = (val == (casword_t) tagptr || val == second->oldval) ? KCAS_STATE_SUCCEEDED : KCAS_STATE_FAILED;
+    }
+
+    if (newstate == KCAS_STATE_SUCCEEDED) kcas_tick_clocks(clocks, ptr);
+    bool successBit;
+    SEQBITS_CAS_FIELD(successBit
+            , ptr->seqBits, ptr->seqBits
+            , KCAS_STATE_UNDECIDED, newstate
+            , KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
+    if (successBit && newstate == KCAS_STATE_FAILED) locked_before_failure.inc(tid);
+
+    // (only we can change the sequence number, so the state can't be stale)
+    const int state = ptr->seqBits & KCAS_SEQBITS_MASK_STATE;
+    const bool succeeded = (state == KCAS_STATE_SUCCEEDED);
+    BOOL_CAS(first->addr, (casword_t) tagptr, decidedValue(*first, succeeded));
+    if (!isCompareOnly(*second)) BOOL_CAS(second->addr, (casword_t) tagptr, decidedValue(*second, succeeded));
+    return state;
+}
+
+template <int MAX_K, class ContentionPolicy>
+bool KCASLockFree<MAX_K, ContentionPolicy>::kcas(const int tid, kcasptr_t ptr) {
+    bool result;
+    if (ptr->numEntries == 1) {
+        result = kcas1(tid, ptr);
+    } else {
+        // sort entries in the kcas descriptor to guarantee progress
+        // (a descriptor that names the same word with two different expected
+        //  values can never succeed, so we fail it before touching memory)
+        if (!(ptr->numEntries == 2 ? kcasdesc_sort2(ptr) : kcasdesc_sort<MAX_K>(ptr))) {
+            kcas_failed.inc(tid);
+            return false;
+        }
+        const int index = ptr - kcasDescriptors; // which of our slots
+        assert(KCAS_DESC_OWNER(index) == tid);
+        DESC_INITIALIZED(kcasDescriptors, index);
+        kcastagptr_t tagptr = TAGPTR_NEW(index, ptr->seqBits, KCAS_TAGBIT);
+
+        // perform the kcas and retire the old descriptor
+        int state;
+        while ((state = (ptr->numEntries == 2 ? kcas2(tid, tagptr, ptr) : help(tid, tagptr, ptr, false))) == KCAS_STATE_RETRY) {
+            kcas_retries.inc(tid);
+            // we hold no words now, so we can help whatever was in our
+            // compare-only words (and fail if they no longer match)
+            for (int i = 0; i < ptr->numEntries; i++) {
+                if (isCompareOnly(ptr->entries[i]) && readPtr(tid, ptr->entries[i].addr) != ptr->entries[i].oldval) {
+                    state = KCAS_STATE_FAILED;
+                    break;
+                }
+            }
+            if (state == KCAS_STATE_FAILED) break;
+            // retry with the same entries, under a new sequence number
+            DESC_NEW(kcasDescriptors, KCAS_SEQBITS_NEW, index);
+            DESC_INITIALIZED(kcasDescriptors, index);
+            tagptr = TAGPTR_NEW(index, ptr->seqBits, KCAS_TAGBIT);
+        }
+        result = (state == KCAS_STATE_SUCCEEDED);
+    }
+    if (result) kcas_succeeded.inc(tid);
+    else kcas_failed.inc(tid);
     return result;
 }
 
-template <int MAX_K>
-casword_t KCASLockFree<MAX_K>::readPtr(const int tid, casword_t volatile * addr) {
+template <int MAX_K, class ContentionPolicy>
+casword_t KCASLockFree<MAX_K, ContentionPolicy>::readPtr(const int tid, casword_t volatile * addr) {
     casword_t r;
     do {
         r = rdcssRead(tid, addr);
         if (isKcas(r)) {
-            helpOther(tid, (kcastagptr_t) r);
+            resolveConflict(tid, addr, (kcastagptr_t) r);
         }
     } while (isKcas(r));
     return r;
 }
 
-template <int MAX_K>
-casword_t KCASLockFree<MAX_K>::readVal(const int tid, casword_t volatile * addr) {
+template <int MAX_K, class ContentionPolicy>
+casword_t KCASLockFree<MAX_K, ContentionPolicy>::readVal(const int tid, casword_t volatile * addr) {
     return ((casword_t) readPtr(tid, addr))>>KCAS_LEFTSHIFT;
 }
 
-template <int MAX_K>
-void KCASLockFree<MAX_K>::writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval) {
+/**
+ * A linearizable snapshot of n words (see kcas_double_collect), validated with
+ * our write clocks. The words are read with readPtr, which helps any kcas
+ * that has locked them.
+ * We can't just take an undecided kcas's oldval: a kcas with compare-only
+ * entries takes effect when it validates them, which is before it is decided,
+ * so its old values may already be out of date.
+ */
+template <int MAX_K, class ContentionPolicy>
+void KCASLockFree<MAX_K, ContentionPolicy>::readManyPtr(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out) {
+    int retries = kcas_double_collect(n, addrs, out, [this, tid](casword_t volatile * addr, casword_t * raw) {
+        return (*raw = readPtr(tid, addr));
+    }, [this](casword_t volatile * addr) {
+        return *kcas_clock_of(clocks, addr);
+    });
+    snapshots.inc(tid);
+    snapshot_retries.add(tid, retries);
+}
+
+template <int MAX_K, class ContentionPolicy>
+void KCASLockFree<MAX_K, ContentionPolicy>::readManyVal(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out) {
+    readManyPtr(tid, n, addrs, out);
+    for (int i = 0; i < n; i++) {
+        out[i] >>= KCAS_LEFTSHIFT;
+    }
+}
+
+template <int MAX_K, class ContentionPolicy>
+void KCASLockFree<MAX_K, ContentionPolicy>::writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval) {
     *addr = newval;
 }
 
-template <int MAX_K>
-void KCASLockFree<MAX_K>::writeInitVal(const int tid, casword_t volatile * addr, casword_t const newval) {
+template <int MAX_K, class ContentionPolicy>
+void KCASLockFree<MAX_K, ContentionPolicy>::writeInitVal(const int tid, casword_t volatile * addr, casword_t const newval) {
     writeInitPtr(tid, addr, newval<<KCAS_LEFTSHIFT);
 }
 
-template <int MAX_K>
-kcasptr_t KCASLockFree<MAX_K>::getDescriptor(const int tid) {
-    // allocate a new kcas descriptor
-    kcasptr_t ptr = DESC_NEW(kcasDescriptors, KCAS_SEQBITS_NEW, tid);
+template <int MAX_K, class ContentionPolicy>
+kcasptr_t KCASLockFree<MAX_K, ContentionPolicy>::getDescriptor(const int tid, const int slot) {
+    assert(tid >= 0 && tid < numThreads);
+    assert(slot >= 0 && slot < KCAS_SLOTS_PER_THREAD);
+    // reuse the descriptor in this slot (whose previous kcas, if any, is over)
+    kcasptr_t ptr = DESC_NEW(kcasDescriptors, KCAS_SEQBITS_NEW, KCAS_DESC_INDEX(tid, slot));
     ptr->numEntries = 0;
     return ptr;
 }
+
+template <int MAX_K, class ContentionPolicy>
+void KCASLockFree<MAX_K, ContentionPolicy>::registerMetrics(MetricsRegistry & registry) {
+    registry.addCounter("kcas_succeeded", &kcas_succeeded);
+    registry.addCounter("kcas_failed", &kcas_failed);
+    registry.addCounter("kcas_helped", &kcas_helped);
+    registry.addCounter("snapshots", &snapshots);
+    registry.addCounter("snapshot_retries", &snapshot_retries);
+    registry.addCounter("rdcss_helped", &rdcss_helped);
+    registry.addCounter("rdcss_retries", &rdcss_retries);
+    registry.addCounter("entry_retries", &entry_retries);
+    registry.addCounter("stale_kcas_snapshots", &stale_kcas_snapshots);
+    registry.addCounter("stale_rdcss_snapshots", &stale_rdcss_snapshots);
+    registry.addCounter("locked_before_failure", &locked_before_failure);
+    registry.addCounter("kcas_retries", &kcas_retries);
+    registry.addCounter("forced_retries", &forced_retries);
+    // (0, not nan, before any kcas has finished or failed)
+    registry.addGauge("helps_per_kcas", [this]() {
+        const long long total = kcas_succeeded.read() + kcas_failed.read();
+        return total ? kcas_helped.read() / (double) total : 0;
+    });
+    registry.addGauge("locked_per_failed_kcas", [this]() {
+        const long long n = kcas_failed.read();
+        return n ? locked_before_failure.read() / (double) n : 0;
+    });
+    std::string policy = ContentionPolicy::name();
+    registry.addCounter(policy + "_conflicts", &conflicts);
+    registry.addCounter(policy + "_conflicts_waited_out", &conflicts_waited_out);
+    registry.addCounter(policy + "_backoff_rounds", &backoff_rounds);
+}
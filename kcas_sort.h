@@ -0,0 +1,160 @@
+/**
+ * Sorting the entries of a KCAS descriptor by address (so every kcas acquires
+ * words in the same global order), and merging entries that name the same
+ * address (so a kcas never waits on, or fails because of, itself).
+ *
+ * Descriptors with up to KCAS_SORTNET_MAXN entries are sorted by a Batcher
+ * odd-even merge sorting network. The comparators for each size are generated
+ * at compile time, so sorting n entries is a fixed sequence of
+ * compare-exchanges with no loops and no data-dependent control flow beyond
+ * the swaps themselves. Larger descriptors fall back to insertion sort.
+ *
+ * This works for any descriptor type with numEntries and entries[], where
+ * each entry has addr, oldval and newval, and isCompareOnly(entry) says
+ * whether it is a compare-only entry.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <utility>
+
+#ifndef KCAS_SORTNET_MAXN
+#define KCAS_SORTNET_MAXN 32
+#endif
+
+// comparator i of the network for n entries is (first[i], second[i])
+template <int N>
+struct kcas_sortnet_t {
+    int first[N*N+1];
+    int second[N*N+1];
+    int size;
+    constexpr kcas_sortnet_t() : first(), second(), size(0) {
+        for (int p = 1; p < N; p += p) {
+            for (int k = p; k >= 1; k /= 2) {
+                for (int j = k % p; j + k < N; j += 2*k) {
+                    for (int i = 0; i < k && i + j + k < N; ++i) {
+                        if ((i + j) / (2*p) == (i + j + k) / (2*p)) {
+                            first[size] = i + j;
+                            second[size] = i + j + k;
+                            ++size;
+                        }
+                    }
+                }
+            }
+        }
+    }
+};
+
+template <int N>
+constexpr kcas_sortnet_t<N> kcas_sortnet = kcas_sortnet_t<N>();
+
+template <class Entry>
+static inline void kcas_sortnet_cmpxchg(Entry & x, Entry & y) {
+    // select rather than branch, so the compiler can use cmovs (swaps are unpredictable)
+    const bool swap = y.addr < x.addr;
+    Entry lo = swap ? y : x;
+    Entry hi = swap ? x : y;
+    x = lo;
+    y = hi;
+}
+
+template <int N, class Entry, int... C>
+static inline void kcas_sortnet_apply(Entry * entries, std::integer_sequence<int, C...>) {
+    (kcas_sortnet_cmpxchg(entries[kcas_sortnet<N>.first[C]], entries[kcas_sortnet<N>.second[C]]), ...);
+}
+
+template <int N, class Entry>
+static inline void kcas_sortnet_sort(Entry * entries) {
+    kcas_sortnet_apply<N>(entries, std::make_integer_sequence<int, kcas_sortnet<N>.size>());
+}
+
+// picks the network for n entries, for n in [N, MAXN]
+template <int N, int MAXN, class Entry>
+struct kcas_sortnet_dispatch {
+    static inline void sort(Entry * entries, const int n) {
+        if (n == N) kcas_sortnet_sort<N>(entries);
+        else kcas_sortnet_dispatch<N+1, MAXN, Entry>::sort(entries, n);
+    }
+};
+
+template <int MAXN, class Entry>
+struct kcas_sortnet_dispatch<MAXN, MAXN, Entry> {
+    static inline void sort(Entry * entries, const int n) {
+        kcas_sortnet_sort<MAXN>(entries);
+    }
+};
+
+template <class Entry>
+static void kcas_insertion_sort(Entry * entries, const int n) {
+    for (int i = 1; i < n; ++i) {
+        Entry x = entries[i];
+        int j = i - 1;
+        for (; j >= 0 && x.addr < entries[j].addr; --j) {
+            entries[j+1] = entries[j];
+        }
+        entries[j+1] = x;
+    }
+}
+
+template <int MAX_K, class Entry>
+static inline void kcas_sort_by_addr(Entry * entries, const int n) {
+    const int MAXN = (MAX_K < KCAS_SORTNET_MAXN) ? MAX_K : KCAS_SORTNET_MAXN;
+    if (n < 2) return;
+    if (MAXN >= 2 && n <= MAXN) kcas_sortnet_dispatch<2, (MAXN >= 2 ? MAXN : 2), Entry>::sort(entries, n);
+    else kcas_insertion_sort(entries, n);
+}
+
+/**
+ * Merge entry y into entry x (for the same address).
+ * All entries are compared against the same state of memory, so two entries
+ * that expect different values mean the kcas can't possibly succeed: we
+ * return false, and the caller should fail the kcas without touching memory.
+ * A compare-only entry merges into any entry that expects the same value
+ * (isCompareOnly(entry) is defined next to each entry type). Two entries that
+ * expect the same value but want to write different ones make no sense;
+ * that's a bug in the caller (asserted), and is also reported as a failed kcas.
+ */
+template <class Entry>
+static inline bool kcas_merge_entries(Entry & x, const Entry & y) {
+    if (x.oldval != y.oldval) return false;
+    if (isCompareOnly(y)) return true;
+    if (isCompareOnly(x)) {
+        x = y;
+        return true;
+    }
+    if (x.newval == y.newval) return true;
+    assert(false);
+    return false;
+}
+
+/**
+ * Sort ptr's entries by address, then collapse entries for the same address
+ * into one (see kcas_merge_entries). Returns false if the kcas can't succeed.
+ */
+template <int MAX_K, class Descriptor>
+static bool kcasdesc_sort(Descriptor * ptr) {
+    const int n = ptr->numEntries;
+    kcas_sort_by_addr<MAX_K>(ptr->entries, n);
+    bool satisfiable = true;
+    int out = 1;
+    for (int i = 1; i < n; ++i) {
+        if (ptr->entries[i].addr == ptr->entries[out-1].addr) {
+            if (!kcas_merge_entries(ptr->entries[out-1], ptr->entries[i])) satisfiable = false;
+            continue;
+        }
+        if (out != i) ptr->entries[out] = ptr->entries[i];
+        ++out;
+    }
+    if (n > 0) ptr->numEntries = out;
+    return satisfiable;
+}
+
+// kcasdesc_sort for exactly two entries, without the loops
+template <class Descriptor>
+static inline bool kcasdesc_sort2(Descriptor * ptr) {
+    kcas_sortnet_cmpxchg(ptr->entries[0], ptr->entries[1]);
+    if (ptr->entries[0].addr != ptr->entries[1].addr) return true;
+    ptr->numEntries = 1;
+    return kcas_merge_entries(ptr->entries[0], ptr->entries[1]);
+}
@@ -1,11 +1,15 @@
 #pragma once
 
+#include "kcas_sort.h"
+
 #define casword_t uintptr_t
 #define descriptor_t typename KCASUnfinished<MAX_K>::kcas_desc_t
 
 template <int MAX_K>
 class KCASUnfinished {
 public:
+    typedef casword_t word_t; // the type of a word that kcas operates on
+
     /**
      * KCAS descriptor type
      * (just used to provide well-formed variable length args to kcas())
@@ -16,6 +20,8 @@ public:
             casword_t volatile * addr;
             casword_t oldval;
             casword_t newval;
+            bool compareOnly;
+            friend bool isCompareOnly(const kcas_entry_t & entry) { return entry.compareOnly; } // (for kcasdesc_sort)
         };
         volatile char padding[PADDING_BYTES]; // add padding to prevent false sharing
         casword_t numEntries;
@@ -25,6 +31,7 @@ public:
             entries[numEntries].addr = addr;
             entries[numEntries].oldval = oldval;
             entries[numEntries].newval = newval;
+            entries[numEntries].compareOnly = false;
             ++numEntries;
             assert(numEntries <= MAX_K);
             //std::cout<<"addr="<<(size_t) addr<<" oldval="<<oldval<<" newval="<<newval<<" numEntries="<<std::endl;
@@ -34,54 +41,59 @@ public:
             entries[numEntries].addr = addr;
             entries[numEntries].oldval = oldval;
             entries[numEntries].newval = newval;
+            entries[numEntries].compareOnly = false;
             ++numEntries;
             assert(numEntries <= MAX_K);
             //std::cout<<"addr="<<(size_t) addr<<" oldval="<<oldval<<" newval="<<newval<<" numEntries="<<std::endl;
         }
+
+        // compare-only entries (the kcas only succeeds if addr contains val, but needn't write it)
+        void addValCompare(casword_t * addr, casword_t val) {
+            addValAddr(addr, val, val);
+            entries[numEntries-1].compareOnly = true;
+        }
+
+        void addPtrCompare(casword_t * addr, casword_t val) {
+            addPtrAddr(addr, val, val);
+            entries[numEntries-1].compareOnly = true;
+        }
     };
 
 private:
-    kcas_desc_t perThreadDescriptors[MAX_THREADS+1] __attribute__ ((aligned(64))); // allocate one extra cell to pad the rightmost array endpoint
+    const int numThreads;
+    kcas_desc_t * perThreadDescriptors; // KCAS_SLOTS_PER_THREAD per thread, plus one extra cell to pad the rightmost array endpoint
 
 public:
-    KCASUnfinished();
+    KCASUnfinished(const int _numThreads = MAX_THREADS);
+    ~KCASUnfinished();
     casword_t readPtr(const int tid, casword_t volatile * addr);
     casword_t readVal(const int tid, casword_t volatile * addr);
+    void readManyPtr(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out);
+    void readManyVal(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out);
     void writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval);
     void writeInitVal(const int tid, casword_t volatile * addr, casword_t const newval);
     bool kcas(const int tid, kcas_desc_t * ptr);
-    kcas_desc_t * getDescriptor(const int tid);
+    kcas_desc_t * getDescriptor(const int tid, const int slot = 0); // see KCAS_SLOTS_PER_THREAD
+    void registerMetrics(MetricsRegistry & registry); // add any counters/gauges you want the benchmark to snapshot
 private:
     // your private functions here
 };
 
 template <int MAX_K>
-KCASUnfinished<MAX_K>::KCASUnfinished() {
-    memset(perThreadDescriptors, 0, sizeof(perThreadDescriptors));
+KCASUnfinished<MAX_K>::KCASUnfinished(const int _numThreads) : numThreads(_numThreads) {
+    perThreadDescriptors = new kcas_desc_t[numThreads*KCAS_SLOTS_PER_THREAD+1];
+    memset(perThreadDescriptors, 0, (numThreads*KCAS_SLOTS_PER_THREAD+1)*sizeof(kcas_desc_t));
 }
 
-// TODO: maybe replace crappy bubble sort with something fast for large MAX_K (maybe even use insertion sort for small MAX_K)
 template <int MAX_K>
-static void kcasdesc_sort(descriptor_t * ptr) {
-    descriptor_t::kcas_entry_t temp;
-    bool changed = false;
-    for (int i = 0; i < ptr->numEntries; i++) {
-        for (int j = 0; j < ptr->numEntries - i - 1; j++) {
-            if (ptr->entries[j].addr > ptr->entries[j + 1].addr) {
-                temp = ptr->entries[j];
-                ptr->entries[j] = ptr->entries[j + 1];
-                ptr->entries[j + 1] = temp;
-                changed = true;
-            }
-        }
-        if (!changed) break;
-    }
+KCASUnfinished<MAX_K>::~KCASUnfinished() {
+    delete[] perThreadDescriptors;
 }
 
 template <int MAX_K>
 bool KCASUnfinished<MAX_K>::kcas(const int tid, descriptor_t * ptr) {
     // sort entries in the kcas descriptor to guarantee progress
-    kcasdesc_sort<MAX_K>(ptr);
+    if (!kcasdesc_sort<MAX_K>(ptr)) return false;
 
     // incomplete implementation
     
@@ -98,6 +110,21 @@ casword_t KCASUnfinished<MAX_K>::readVal(const int tid, casword_t volatile * add
     return *addr;
 }
 
+template <int MAX_K>
+void KCASUnfinished<MAX_K>::readManyPtr(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out) {
+    // incomplete implementation (not a consistent snapshot)
+    for (int i = 0; i < n; i++) {
+        out[i] = readPtr(tid, addrs[i]);
+    }
+}
+
+template <int MAX_K>
+void KCASUnfinished<MAX_K>::readManyVal(const int tid, const int n, casword_t volatile * const * addrs, casword_t * out) {
+    for (int i = 0; i < n; i++) {
+        out[i] = readVal(tid, addrs[i]);
+    }
+}
+
 template <int MAX_K>
 void KCASUnfinished<MAX_K>::writeInitPtr(const int tid, casword_t volatile * addr, casword_t const newval) {
     *addr = newval;
@@ -109,7 +136,13 @@ void KCASUnfinished<MAX_K>::writeInitVal(const int tid, casword_t volatile * add
 }
 
 template <int MAX_K>
-descriptor_t * KCASUnfinished<MAX_K>::getDescriptor(const int tid) {
-    perThreadDescriptors[tid].numEntries = 0;
-    return &perThreadDescriptors[tid];
+descriptor_t * KCASUnfinished<MAX_K>::getDescriptor(const int tid, const int slot) {
+    const int index = tid*KCAS_SLOTS_PER_THREAD + slot;
+    perThreadDescriptors[index].numEntries = 0;
+    return &perThreadDescriptors[index];
+}
+
+template <int MAX_K>
+void KCASUnfinished<MAX_K>::registerMetrics(MetricsRegistry & registry) {
+    
 }
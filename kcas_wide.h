@@ -0,0 +1,420 @@
+#pragma once
+
+#include "kcas_reuse_impl.h"
+
+/**
+ * KCAS on 16-byte words: each word is a full 64-bit value next to a 64-bit
+ * tag, and both halves are updated together with cmpxchg16b (compile with
+ * -mcx16). So values are not shifted, and any 64-bit value (counter, hash,
+ * unaligned pointer) can be stored.
+ *
+ * The algorithm is the one in KCASEfficient (kcas_efficient.h). The tag is 0,
+ * or it is the tagged pointer of the kcas descriptor that has installed itself
+ * in the word, or (briefly) that of an rdcss that is installing one. Installing
+ * a descriptor leaves in the val half the value the word had just before. So:
+ * - the value of a word is val if tag is 0 or its descriptor has not
+ *   succeeded, and is the descriptor's newval otherwise;
+ * - a reader that sees tag 0 can simply return val, without rereading the
+ *   tag. Even if descriptors were installed after it read the tag, val is a
+ *   value the word had at some point after that read.
+ * An rdcss only installs over tag 0 (a helper first detaches a decided
+ * descriptor it finds in the word), so if the kcas has been decided it can
+ * simply put back tag 0, and only needs the fields of an rdcssdesc_t.
+ * There is no 16-byte atomic load, so a 16-byte expected value for a CAS is
+ * put together from two 8-byte loads. If they are from different moments
+ * the CAS fails, and we retry.
+ */
+
+struct kcaswideword_t {
+    volatile casword_t val;
+    volatile casword_t tag;
+} __attribute__ ((aligned(16)));
+
+#define kcaswideptr_t kcaswidedesc_t<MAX_K>*
+
+struct kcaswideentry_t { // just part of kcaswidedesc_t, not a standalone descriptor
+    kcaswideword_t volatile * addr;
+    casword_t oldval;
+    casword_t newval;
+    bool compareOnly; // (every 64-bit newval is a valid value, so there is no newval we could reserve for this)
+};
+
+static bool isCompareOnly(const kcaswideentry_t & entry) {
+    return entry.compareOnly;
+}
+
+template <int MAX_K>
+class kcaswidedesc_t {
+public:
+    volatile seqbits_t seqBits;
+    casword_t numEntries;
+    kcaswideentry_t entries[MAX_K];
+    const static int size = sizeof(seqBits)+sizeof(numEntries)+sizeof(entries);
+
+    void addValAddr(kcaswideword_t * addr, casword_t oldval, casword_t newval) {
+        entries[numEntries].addr = addr;
+        entries[numEntries].oldval = oldval;
+        entries[numEntries].newval = newval;
+        entries[numEntries].compareOnly = false;
+        ++numEntries;
+        assert(numEntries <= MAX_K);
+    }
+
+    void addPtrAddr(kcaswideword_t * addr, casword_t oldval, casword_t newval) {
+        addValAddr(addr, oldval, newval);
+    }
+
+    // (newval is val, so succeeding leaves the word's value as it was)
+    void addValCompare(kcaswideword_t * addr, casword_t val) {
+        addValAddr(addr, val, val);
+        entries[numEntries-1].compareOnly = true;
+    }
+
+    void addPtrCompare(kcaswideword_t * addr, casword_t val) {
+        addValCompare(addr, val);
+    }
+} __attribute__ ((aligned(64))); // see rdcssdesc_t for the layout (our entries are bigger, so only the first one is on the first cache line)
+
+static inline bool wideCAS(kcaswideword_t volatile * addr, casword_t oldval, casword_t oldtag, casword_t newval, casword_t newtag) {
+    typedef unsigned __int128 wide_t;
+    return __sync_bool_compare_and_swap((wide_t volatile *) addr
+            , (((wide_t) oldtag)<<64) | oldval
+            , (((wide_t) newtag)<<64) | newval);
+}
+
+template <int MAX_K>
+class KCASWide {
+public:
+    typedef kcaswideword_t word_t;
+private:
+    volatile char __padding_desc[128];
+    const int numThreads;       // tids are in [0, numThreads)
+    kcaswidedesc_t<MAX_K> * kcasDescriptors; // KCAS_SLOTS_PER_THREAD per thread (see KCAS_DESC_INDEX)
+    rdcssdesc_t * rdcssDescriptors;      // one per thread (addr2 is a kcaswideword_t)
+    kcasclock_t * clocks;                // KCAS_CLOCKS of them (see kcasclock_t)
+    volatile char __padding_desc3[128];
+    StatCounter kcas_succeeded;
+    StatCounter kcas_failed;
+    StatCounter kcas_helped;    // undecided descriptors of other threads we helped
+    StatCounter rdcss_helped;   // rdcss descriptors of other threads we helped
+    StatCounter detached_words; // words still pointing to our previous descriptor when we reused it
+    StatCounter snapshots;      // readMany calls
+    StatCounter snapshot_retries; // extra collects readMany needed because words changed
+    volatile char __padding_desc4[128];
+
+public:
+    KCASWide(const int _numThreads = MAX_THREADS);
+    ~KCASWide();
+    void writeInitPtr(const int tid, kcaswideword_t volatile * addr, casword_t const newval);
+    void writeInitVal(const int tid, kcaswideword_t volatile * addr, casword_t const newval);
+    casword_t readPtr(const int tid, kcaswideword_t volatile * addr);
+    casword_t readVal(const int tid, kcaswideword_t volatile * addr);
+    void readManyPtr(const int tid, const int n, kcaswideword_t volatile * const * addrs, casword_t * out);
+    void readManyVal(const int tid, const int n, kcaswideword_t volatile * const * addrs, casword_t * out);
+    bool kcas(const int tid, kcaswideptr_t ptr);
+    kcaswideptr_t getDescriptor(const int tid, const int slot = 0);
+    void registerMetrics(MetricsRegistry & registry);
+private:
+    bool kcas1(const int tid, kcaswideptr_t ptr);
+    bool valueOf(kcastagptr_t tagptr, kcaswideword_t volatile * addr, casword_t * value, int * state);
+    void help(const int tid, kcastagptr_t tagptr, kcaswideptr_t snapshot, bool helpingOther);
+    void helpOther(const int tid, kcastagptr_t tagptr);
+    void detach(const int tid, const int index);
+    void rdcssHelp(rdcsstagptr_t tagptr, rdcssptr_t snapshot);
+    void rdcssHelpOther(const int tid, rdcsstagptr_t tagptr);
+};
+
+template <int MAX_K>
+KCASWide<MAX_K>::KCASWide(const int _numThreads) : numThreads(_numThreads) {
+    assert(numThreads > 0 && numThreads*KCAS_SLOTS_PER_THREAD < LAST_TID-1);
+    kcasDescriptors = new kcaswidedesc_t<MAX_K>[numThreads*KCAS_SLOTS_PER_THREAD];
+    DESC_INIT_ALL(kcasDescriptors, KCAS_SEQBITS_NEW, numThreads*KCAS_SLOTS_PER_THREAD);
+    for (int i=0;i<numThreads*KCAS_SLOTS_PER_THREAD;++i) {
+        kcasDescriptors[i].numEntries = 0;
+    }
+    rdcssDescriptors = new rdcssdesc_t[numThreads];
+    DESC_INIT_ALL(rdcssDescriptors, RDCSS_SEQBITS_NEW, numThreads);
+    clocks = kcas_clocks_new();
+    kcas_succeeded.init(numThreads);
+    kcas_failed.init(numThreads);
+    kcas_helped.init(numThreads);
+    rdcss_helped.init(numThreads);
+    detached_words.init(numThreads);
+    snapshots.init(numThreads);
+    snapshot_retries.init(numThreads);
+}
+
+template <int MAX_K>
+KCASWide<MAX_K>::~KCASWide() {
+    delete[] kcasDescriptors;
+    delete[] rdcssDescriptors;
+    delete[] clocks;
+}
+
+/**
+ * Determine the value of addr, whose tag is tagptr, and the state of the
+ * descriptor tagptr points to. Returns false if addr's tag is no longer
+ * tagptr (so the caller should reread it).
+ */
+template <int MAX_K>
+bool KCASWide<MAX_K>::valueOf(kcastagptr_t tagptr, kcaswideword_t volatile * addr, casword_t * value, int * state) {
+    kcaswideptr_t ptr = TAGPTR_UNPACK_PTR(kcasDescriptors, tagptr);
+    bool successBit;
+    *state = DESC_READ_FIELD(successBit, ptr->seqBits, tagptr, KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
+    if (!successBit) return false;
+    if (*state != KCAS_STATE_SUCCEEDED) {
+        // the word still has the value it had before tagptr was installed
+        *value = addr->val;
+        return addr->tag == tagptr;
+    }
+    __asm__ __volatile__ ("":::"memory");
+    const int n = ptr->numEntries;
+    int i = 0;
+    while (i < n && ptr->entries[i].addr != addr) ++i;
+    if (i == n) return false;
+    *value = ptr->entries[i].newval;
+    __asm__ __volatile__ ("":::"memory");
+    return (ptr->seqBits & MASK_SEQ) == (tagptr & MASK_SEQ);
+}
+
+// install snapshot->new2 as the tag of addr2 (whose tag is now tagptr) if the kcas is undecided, and put back tag 0 otherwise
+template <int MAX_K>
+void KCASWide<MAX_K>::rdcssHelp(rdcsstagptr_t tagptr, rdcssptr_t snapshot) {
+    kcaswideword_t volatile * addr = (kcaswideword_t volatile *) snapshot->addr2;
+    bool readSuccess;
+    casword_t v = DESC_READ_FIELD(readSuccess, *snapshot->addr1, snapshot->old1, KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
+    if (!readSuccess) v = KCAS_STATE_SUCCEEDED; // the kcas descriptor has been reused, so it was decided
+    wideCAS(addr, snapshot->old2, tagptr, snapshot->old2, (v == KCAS_STATE_UNDECIDED) ? snapshot->new2 : 0);
+}
+
+template <int MAX_K>
+void KCASWide<MAX_K>::rdcssHelpOther(const int tid, rdcsstagptr_t tagptr) {
+    rdcssdesc_t snapshot;
+    rdcss_helped.inc(tid);
+    if (DESC_SNAPSHOT(rdcssdesc_t, rdcssDescriptors, &snapshot, tagptr, rdcssdesc_t::size)) {
+        rdcssHelp(tagptr, &snapshot);
+    }
+}
+
+// (see KCASEfficient::help)
+template <int MAX_K>
+void KCASWide<MAX_K>::help(const int tid, kcastagptr_t tagptr, kcaswideptr_t snapshot, bool helpingOther) {
+    kcaswideptr_t ptr = TAGPTR_UNPACK_PTR(kcasDescriptors, tagptr);
+    int newstate = KCAS_STATE_SUCCEEDED;
+    // the owner installs entry 0 before anyone can find the descriptor, so helpers start at entry 1
+    for (int i = helpingOther; i < snapshot->numEntries; i++) {
+        kcaswideword_t volatile * addr = snapshot->entries[i].addr;
+retry_entry:
+        casword_t tag = addr->tag;
+        casword_t content = addr->val;
+        if (tag == (casword_t) tagptr) continue; // someone installed it already
+        if (isRdcss(tag)) {
+            rdcssHelpOther(tid, (rdcsstagptr_t) tag);
+            goto retry_entry;
+        }
+        casword_t val = content;
+        if (tag) {
+            int state;
+            if (!valueOf((kcastagptr_t) tag, addr, &val, &state)) goto retry_entry;
+            if (state == KCAS_STATE_UNDECIDED) {
+                helpOther(tid, (kcastagptr_t) tag);
+                // someone might have decided us while we were helping
+                if ((ptr->seqBits & KCAS_SEQBITS_MASK_STATE) != KCAS_STATE_UNDECIDED) break;
+                goto retry_entry;
+            }
+        }
+        if (val != snapshot->entries[i].oldval) {
+            newstate = KCAS_STATE_FAILED;
+            break;
+        }
+        if (!helpingOther && i == 0) {
+            if (!wideCAS(addr, content, tag, val, tagptr)) goto retry_entry;
+        } else if (tag) {
+            // detach the decided descriptor first, so an rdcss only ever has to put back tag 0
+            wideCAS(addr, content, tag, val, 0);
+            goto retry_entry;
+        } else {
+            rdcssdesc_t *rdcssptr = DESC_NEW(rdcssDescriptors, RDCSS_SEQBITS_NEW, tid);
+            rdcssptr->addr1 = (casword_t*) &ptr->seqBits;
+            rdcssptr->old1 = tagptr; // pass the sequence number (as part of tagptr)
+            rdcssptr->old2 = val;
+            rdcssptr->addr2 = (casword_t volatile *) addr;
+            rdcssptr->new2 = (casword_t) tagptr;
+            DESC_INITIALIZED(rdcssDescriptors, tid);
+            rdcsstagptr_t rdcsstagptr = TAGPTR_NEW(tid, rdcssptr->seqBits, RDCSS_TAGBIT);
+            if (!wideCAS(addr, val, 0, val, rdcsstagptr)) goto retry_entry;
+            rdcssHelp(rdcsstagptr, rdcssptr);
+        }
+    }
+
+    // decide (unless someone else did first)
+    if (newstate == KCAS_STATE_SUCCEEDED) kcas_tick_clocks(clocks, snapshot);
+    bool successBit;
+    SEQBITS_CAS_FIELD(successBit
+            , ptr->seqBits, snapshot->seqBits
+            , KCAS_STATE_UNDECIDED, newstate
+            , KCAS_SEQBITS_MASK_STATE, KCAS_SEQBITS_OFFSET_STATE);
+}
+
+template <int MAX_K>
+void KCASWide<MAX_K>::helpOther(const int tid, kcastagptr_t tagptr) {
+    kcaswidedesc_t<MAX_K> snapshot;
+    if (!KCASDESC_SNAPSHOT(kcaswidedesc_t<MAX_K>, kcasDescriptors, &snapshot, tagptr)) return;
+    kcas_helped.inc(tid);
+    help(tid, tagptr, &snapshot, true);
+}
+
+template <int MAX_K>
+void KCASWide<MAX_K>::detach(const int tid, const int index) {
+    kcaswideptr_t ptr = &kcasDescriptors[index];
+    kcastagptr_t tagptr = TAGPTR_NEW(index, ptr->seqBits, KCAS_TAGBIT);
+    bool succeeded = ((ptr->seqBits & KCAS_SEQBITS_MASK_STATE) == KCAS_STATE_SUCCEEDED);
+    for (int i = 0; i < ptr->numEntries; i++) {
+        kcaswideword_t volatile * addr = ptr->entries[i].addr;
+        while (1) {
+            casword_t tag = addr->tag;
+            // an rdcss in this word might still install our descriptor, so finish it first
+            if (isRdcss(tag)) {
+                rdcssHelpOther(tid, (rdcsstagptr_t) tag);
+                continue;
+            }
+            if (tag != (casword_t) tagptr) break;
+            casword_t val = succeeded ? ptr->entries[i].newval : ptr->entries[i].oldval;
+            if (wideCAS(addr, ptr->entries[i].oldval, tagptr, val, 0)) detached_words.inc(tid);
+        }
+    }
+}
+
+template <int MAX_K>
+bool KCASWide<MAX_K>::kcas1(const int tid, kcaswideptr_t ptr) {
+    kcaswideword_t volatile * addr = ptr->entries[0].addr;
+    casword_t volatile * clock = kcas_clock_of(clocks, addr);
+    while (1) {
+        casword_t tag = addr->tag;
+        casword_t content = addr->val;
+        if (isRdcss(tag)) {
+            rdcssHelpOther(tid, (rdcsstagptr_t) tag);
+            continue;
+        }
+        casword_t val = content;
+        if (tag) {
+            int state;
+            if (!valueOf((kcastagptr_t) tag, addr, &val, &state)) continue;
+            if (state == KCAS_STATE_UNDECIDED) {
+                helpOther(tid, (kcastagptr_t) tag);
+                continue;
+            }
+        }
+        if (val != ptr->entries[0].oldval) return false;
+        if (kcas_clocked_cas(clock, [&]() { return wideCAS(addr, content, tag, ptr->entries[0].newval, 0); })) return true;
+    }
+}
+
+template <int MAX_K>
+bool KCASWide<MAX_K>::kcas(const int tid, kcaswideptr_t ptr) {
+    if (ptr->numEntries == 1) {
+        bool result = kcas1(tid, ptr);
+        if (result) kcas_succeeded.inc(tid);
+        else kcas_failed.inc(tid);
+        return result;
+    }
+
+    // sort entries in the kcas descriptor to guarantee progress
+    if (!(ptr->numEntries == 2 ? kcasdesc_sort2(ptr) : kcasdesc_sort<MAX_K>(ptr))) {
+        kcas_failed.inc(tid);
+        return false;
+    }
+    const int index = ptr - kcasDescriptors; // which of our slots
+    assert(KCAS_DESC_OWNER(index) == tid);
+    DESC_INITIALIZED(kcasDescriptors, index);
+    kcastagptr_t tagptr = TAGPTR_NEW(index, ptr->seqBits, KCAS_TAGBIT);
+
+    // install our tag in each word (leaving its current value beside it), then decide
+    help(tid, tagptr, ptr, false);
+    bool result = ((ptr->seqBits & KCAS_SEQBITS_MASK_STATE) == KCAS_STATE_SUCCEEDED);
+    if (result) kcas_succeeded.inc(tid);
+    else kcas_failed.inc(tid);
+    return result;
+}
+
+template <int MAX_K>
+casword_t KCASWide<MAX_K>::readPtr(const int tid, kcaswideword_t volatile * addr) {
+    while (1) {
+        casword_t tag = addr->tag;
+        if (!tag) return addr->val;
+        if (isRdcss(tag)) {
+            rdcssHelpOther(tid, (rdcsstagptr_t) tag);
+            continue;
+        }
+        casword_t val;
+        int state;
+        if (valueOf((kcastagptr_t) tag, addr, &val, &state)) return val;
+    }
+}
+
+template <int MAX_K>
+casword_t KCASWide<MAX_K>::readVal(const int tid, kcaswideword_t volatile * addr) {
+    return readPtr(tid, addr);
+}
+
+// a linearizable snapshot of n words (see kcas_double_collect), validated with our write clocks
+template <int MAX_K>
+void KCASWide<MAX_K>::readManyPtr(const int tid, const int n, kcaswideword_t volatile * const * addrs, casword_t * out) {
+    int retries = kcas_double_collect(n, addrs, out, [this, tid](kcaswideword_t volatile * addr, casword_t * raw) {
+        while (1) {
+            casword_t tag = addr->tag;
+            if (isRdcss(tag)) {
+                rdcssHelpOther(tid, (rdcsstagptr_t) tag);
+                continue;
+            }
+            *raw = tag;
+            if (!tag) return (casword_t) addr->val;
+            casword_t val;
+            int state;
+            if (valueOf((kcastagptr_t) tag, addr, &val, &state)) return val;
+        }
+    }, [this](kcaswideword_t volatile * addr) {
+        return *kcas_clock_of(clocks, addr);
+    });
+    snapshots.inc(tid);
+    snapshot_retries.add(tid, retries);
+}
+
+template <int MAX_K>
+void KCASWide<MAX_K>::readManyVal(const int tid, const int n, kcaswideword_t volatile * const * addrs, casword_t * out) {
+    readManyPtr(tid, n, addrs, out);
+}
+
+template <int MAX_K>
+void KCASWide<MAX_K>::writeInitPtr(const int tid, kcaswideword_t volatile * addr, casword_t const newval) {
+    addr->val = newval;
+    addr->tag = 0;
+}
+
+template <int MAX_K>
+void KCASWide<MAX_K>::writeInitVal(const int tid, kcaswideword_t volatile * addr, casword_t const newval) {
+    writeInitPtr(tid, addr, newval);
+}
+
+template <int MAX_K>
+kcaswideptr_t KCASWide<MAX_K>::getDescriptor(const int tid, const int slot) {
+    assert(tid >= 0 && tid < numThreads);
+    assert(slot >= 0 && slot < KCAS_SLOTS_PER_THREAD);
+    // clean up after the previous kcas in this slot, then reuse its descriptor
+    const int index = KCAS_DESC_INDEX(tid, slot);
+    detach(tid, index);
+    kcaswideptr_t ptr = DESC_NEW(kcasDescriptors, KCAS_SEQBITS_NEW, index);
+    ptr->numEntries = 0;
+    return ptr;
+}
+
+template <int MAX_K>
+void KCASWide<MAX_K>::registerMetrics(MetricsRegistry & registry) {
+    registry.addCounter("kcas_succeeded", &kcas_succeeded);
+    registry.addCounter("kcas_failed", &kcas_failed);
+    registry.addCounter("kcas_helped", &kcas_helped);
+    registry.addCounter("rdcss_helped", &rdcss_helped);
+    registry.addCounter("detached_words", &detached_words);
+    registry.addCounter("snapshots", &snapshots);
+    registry.addCounter("snapshot_retries", &snapshot_retries);
+}
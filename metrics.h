@@ -0,0 +1,129 @@
+/**
+ * Named metrics that data structures register once, and that the benchmarks
+ * snapshot periodically and dump as JSON or CSV at the end of a trial.
+ *
+ * A counter is a StatCounter (util.h) owned by the data structure, so the
+ * per-thread padded storage and the cost of updating it are unchanged.
+ * A gauge is a callback that reads some current value (table size, estimated
+ * number of keys, ...). Snapshots are taken by the main thread while the
+ * workers run, so counters are read with relaxed loads and gauges should only
+ * read things that are safe to read racily.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <iostream>
+#include <fstream>
+
+struct metrics_options_t {
+    int periodMillis;       // take a snapshot this often while the trial runs (0 = only at the end)
+    const char * jsonFile;  // write the snapshots here as JSON (NULL = don't)
+    const char * csvFile;   // write the snapshots here as CSV (NULL = don't)
+    metrics_options_t() : periodMillis(0), jsonFile(NULL), csvFile(NULL) {}
+};
+
+class MetricsRegistry {
+private:
+    struct metric_t {
+        std::string name;
+        bool isCounter;
+        StatCounter * counter;
+        std::function<double()> gauge;
+    };
+    struct snapshot_t {
+        long long elapsedMillis;
+        std::vector<double> values; // one per metric, in registration order
+    };
+    std::vector<metric_t> metrics;
+    std::vector<snapshot_t> snapshots;
+
+    // counts print as integers (not 1.64752e+06); NaN (e.g., an average over nothing) prints as null
+    static void writeValue(std::ostream & out, const double v) {
+        if (v != v) out<<"null";
+        else if (v > -1e15 && v < 1e15 && v == (double) (long long) v) out<<(long long) v;
+        else out<<v;
+    }
+public:
+    void addCounter(const std::string & name, StatCounter * counter) {
+        metric_t m = { name, true, counter, std::function<double()>() };
+        metrics.push_back(m);
+    }
+    void addGauge(const std::string & name, std::function<double()> gauge) {
+        metric_t m = { name, false, NULL, gauge };
+        metrics.push_back(m);
+    }
+    void snapshot(const long long elapsedMillis) {
+        snapshot_t s;
+        s.elapsedMillis = elapsedMillis;
+        for (size_t i=0;i<metrics.size();++i) {
+            s.values.push_back(metrics[i].isCounter ? (double) metrics[i].counter->read() : metrics[i].gauge());
+        }
+        snapshots.push_back(s);
+    }
+    int numSnapshots() {
+        return snapshots.size();
+    }
+
+    // {"metrics": [{"name": ..., "kind": ...}, ...], "snapshots": [{"elapsed_ms": ..., "<name>": ..., ...}, ...]}
+    void writeJSON(std::ostream & out) {
+        out<<"{"<<std::endl<<"  \"metrics\": [";
+        for (size_t i=0;i<metrics.size();++i) {
+            out<<(i ? ", " : "")<<"{\"name\": \""<<metrics[i].name<<"\", \"kind\": \""<<(metrics[i].isCounter ? "counter" : "gauge")<<"\"}";
+        }
+        out<<"],"<<std::endl<<"  \"snapshots\": ["<<std::endl;
+        for (size_t s=0;s<snapshots.size();++s) {
+            out<<"    {\"elapsed_ms\": "<<snapshots[s].elapsedMillis;
+            for (size_t i=0;i<metrics.size();++i) {
+                out<<", \""<<metrics[i].name<<"\": ";
+                writeValue(out, snapshots[s].values[i]);
+            }
+            out<<"}"<<(s+1 < snapshots.size() ? "," : "")<<std::endl;
+        }
+        out<<"  ]"<<std::endl<<"}"<<std::endl;
+    }
+
+    // one row per snapshot, one column per metric
+    void writeCSV(std::ostream & out) {
+        out<<"elapsed_ms";
+        for (size_t i=0;i<metrics.size();++i) out<<","<<metrics[i].name;
+        out<<std::endl;
+        for (size_t s=0;s<snapshots.size();++s) {
+            out<<snapshots[s].elapsedMillis;
+            for (size_t i=0;i<metrics.size();++i) {
+                out<<",";
+                writeValue(out, snapshots[s].values[i]);
+            }
+            out<<std::endl;
+        }
+    }
+
+    // the most recent snapshot as "name : value" lines (e.g., a per-run breakdown on stdout)
+    void printLatest(std::ostream & out) {
+        if (snapshots.empty()) return;
+        const snapshot_t & s = snapshots.back();
+        for (size_t i=0;i<metrics.size();++i) {
+            out<<metrics[i].name;
+            for (size_t j=metrics[i].name.size();j<28;++j) out<<" ";
+            out<<" : ";
+            writeValue(out, s.values[i]);
+            out<<std::endl;
+        }
+    }
+
+    // writes whichever files the options ask for; returns false if one couldn't be opened
+    bool writeFiles(const metrics_options_t & options) {
+        bool ok = true;
+        if (options.jsonFile) {
+            std::ofstream out(options.jsonFile);
+            if (out) writeJSON(out); else ok = false;
+        }
+        if (options.csvFile) {
+            std::ofstream out(options.csvFile);
+            if (out) writeCSV(out); else ok = false;
+        }
+        return ok;
+    }
+};
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cassert>
+#include <climits>
+#include <cstdlib>
 #include <pthread.h>
 using namespace std;
 
@@ -20,102 +22,556 @@ uint32_t murmur3_32(int k) {
     return h;
 }
 
+/**
+ * Open addressing (linear probing) set that grows and compacts online.
+ *
+ * Once the slots that have left EMPTY (keys and tombstones) exceed
+ * MAX_LOAD_PERCENT of the capacity, a new table is published in
+ * table_t::next and the old table is migrated into it in chunks of
+ * MIGRATION_CHUNK slots. The new table is twice as large if the live keys
+ * alone would fill more than half of MAX_LOAD_PERCENT, and otherwise it has
+ * the same size, which makes the migration a copy-compaction pass that drops
+ * every tombstone (see startMigration). Every operation that sees a migration in progress
+ * claims and migrates one chunk before doing its own work, so no single
+ * thread pays for the whole rehash.
+ *
+ * Migrating a slot freezes it: EMPTY and TOMBSTONE slots are CASed to MOVED,
+ * and a key gets FROZEN_BIT set while it is copied, and then becomes MOVED.
+ * An operation that runs into a frozen or moved slot helps finish the
+ * migration and retries on the new table. Nothing waits for anyone: the new
+ * table is published with a CAS (a thread that needs it and doesn't see it
+ * allocates its own candidate), any thread can copy a frozen key and move its
+ * slot, and a thread that finds every chunk claimed but not finished just
+ * migrates those chunks too. A chunk is done once someone has seen every one
+ * of its slots MOVED, whoever claimed it.
+ *
+ * Copying is idempotent: a key is copied by claiming the first EMPTY slot on
+ * its probe path in the new table as COPY(key), or by finding COPY(key) or key
+ * there (every copier of a key stops at the same slot), and COPY(key) becomes
+ * key only while the old slot is still frozen. A copier that finds the old
+ * slot already MOVED is late (the key may have been erased from the new table
+ * since), so it turns its claim into a TOMBSTONE instead. A slot only holds
+ * COPY(key) once, since it was EMPTY before, so these CASes can't suffer ABA.
+ * Operations treat COPY slots like tombstones they can't reuse.
+ *
+ * With set_options_t::reuseTombstones, inserts can also claim the first
+ * tombstone on their probe path (see insertReusingTombstones). This uses
+ * RESERVED_BIT, and the sign bit is used for freezing, so keys must be in
+ * [1, RESERVED_BIT). That protocol doesn't wait for anyone either: an insert
+ * whose reservation loses to another one finishes the winner itself.
+ * So the set is lock-free: a thread only retries when some other operation
+ * (or migration step) has made progress.
+ */
 class SetHashTableLockfree {
 private:
     static const int EMPTY = 0;
     static const int TOMBSTONE = -1;
+    static const int MOVED = INT_MIN;
+    static const int FROZEN_BIT = INT_MIN;
+    static const int RESERVED_BIT = 1<<30; // key|RESERVED_BIT marks a slot reserved for key by an insert that is validating
+    static const int COPY_BITS = FROZEN_BIT | RESERVED_BIT; // key|COPY_BITS marks a slot claimed by a migration for a copy of key
+    static const int MAX_LOAD_PERCENT = 75;
+    static const int MIGRATION_CHUNK = 4096;
+    static constexpr int MAX_COUNTER_BATCH = 64; // (constexpr, so min() can bind a reference to it without an out-of-class definition)
+    static const int MAX_PASS_LOG = 16;
+
+    struct table_t {
+        volatile char padding0[PADDING_BYTES];
+        int * data;
+        int capacity;
+        int numChunks;
+        table_t * prev;         // older tables are only freed when the set is destroyed
+        volatile char padding1[PADDING_BYTES];
+        SizeEstimator usedSlots; // slots that have left EMPTY; crossing MAX_LOAD_PERCENT starts a migration
+        SizeEstimator liveKeys;  // keys in this table
+        volatile char padding2[PADDING_BYTES];
+        table_t * volatile next; // successor table, non-NULL once a migration out of this table has started
+        volatile int resizing;  // set by the first thread that allocates a candidate for next (others needn't bother unless they need it)
+        volatile char padding3[PADDING_BYTES];
+        volatile int chunksClaimed;
+        volatile char padding4[PADDING_BYTES];
+        volatile int chunksDone;
+        volatile int * chunkDone; // 1 once every slot of the chunk is MOVED
+        volatile int64_t tombstonesSeen; // totals over the slots migrated so far
+        volatile int64_t keysCopied;
+        volatile int64_t lateCopies; // claims in next that late copiers turned into TOMBSTONEs (see copyFrozen)
+        volatile char padding5[PADDING_BYTES];
+
+        table_t(const int _capacity, const int _numThreads, table_t * _prev)
+                : capacity(_capacity), prev(_prev), next(NULL), resizing(0)
+                , chunksClaimed(0), chunksDone(0), tombstonesSeen(0), keysCopied(0), lateCopies(0) {
+            data = (int *) calloc(capacity, sizeof(int)); // EMPTY == 0, and calloc gets zeroed pages lazily instead of one thread filling the array
+            numChunks = (capacity + MIGRATION_CHUNK - 1) / MIGRATION_CHUNK;
+            chunkDone = (volatile int *) calloc(numChunks, sizeof(int));
+            long long maxError = min((long long) _numThreads * MAX_COUNTER_BATCH, (long long) capacity / 16);
+            usedSlots.init(_numThreads, maxError);
+            liveKeys.init(_numThreads, maxError);
+            usedSlots.setThresholds(LLONG_MIN, (long long) capacity * MAX_LOAD_PERCENT / 100);
+        }
+        ~table_t() {
+            free(data);
+            free((void *) chunkDone);
+        }
+    };
+
+    struct pass_t { // a migration out of a table (its totals are read when printed, once every copier is done)
+        table_t * from;
+    };
+
     volatile char padding0[PADDING_BYTES];
-    int * data;
+    table_t * volatile current;
     volatile char padding1[PADDING_BYTES];
     const int numThreads;
-    const int capacity;
+    const bool reuseTombstones;
     volatile char padding2[PADDING_BYTES];
-    Sharded  failed_inserts;
+    StatCounter  failed_inserts;
     volatile char padding3[PADDING_BYTES];
-    Sharded successful_inserts;
+    StatCounter successful_inserts;
     volatile char padding4[PADDING_BYTES];
-    Sharded someone_else_inserts;
+    StatCounter someone_else_inserts;
     volatile char padding5[PADDING_BYTES];
-    Sharded  failed_erase;
+    StatCounter  failed_erase;
     volatile char padding6[PADDING_BYTES];
-    Sharded  successful_erase;
+    StatCounter  successful_erase;
     volatile char padding7[PADDING_BYTES];
+    StatCounter  growth_passes;
+    volatile char padding8[PADDING_BYTES];
+    StatCounter  compaction_passes;
+    volatile char padding9[PADDING_BYTES];
+    StatCounter  migrated_chunks;
+    volatile char padding10[PADDING_BYTES];
+    StatCounter  reused_tombstones;
+    StatCounter insert_probes; // slots examined, to report the average probe length
+    StatCounter erase_probes;
+    StatCounter validation_probes; // slots examined by insertReusingTombstones after reserving
+    StatCounter finished_reservations; // winning reservations of other inserts that we finalized (as our own insert)
+    pass_t passes[MAX_PASS_LOG]; // the most recent passes
+    volatile int numPasses;
+    volatile char padding11[PADDING_BYTES];
+
+    static bool isCopy(const int v) { return v != TOMBSTONE && (v & COPY_BITS) == COPY_BITS; }
+    static bool isMigrating(const int v) { return v < 0 && v != TOMBSTONE && !isCopy(v); } // MOVED or a frozen key
+    static bool isReserved(const int v) { return v >= RESERVED_BIT; }
+    enum { VALID, FOUND_KEY, FOUND_WINNER, FOUND_MIGRATION }; // (see validateReservation)
+    bool insertReusingTombstones(const int tid, const int & key);
+    int validateReservation(const int tid, table_t * t, const unsigned int hash, const int key, const unsigned int slot, unsigned int * winner);
+    void countSlots(const int tid, table_t * t, const int used, const int live);
+    void startMigration(const int tid, table_t * t, const bool needed);
+    void helpMigration(const int tid, table_t * t);
+    table_t * finishMigration(const int tid, table_t * t);
+    void migrateChunk(const int tid, table_t * t, const int chunk);
+    bool copyFrozen(const int tid, table_t * t, const int index, const int key, int * claimed);
 public:
-    SetHashTableLockfree(const int _numThreads, const int _size);
+    SetHashTableLockfree(const int _numThreads, const int _size, const set_options_t & _options = set_options_t());
     ~SetHashTableLockfree();
     bool insertIfAbsent(const int tid, const int & key); // try to insert key; return true if successful (if it doesn't already exist), false otherwise
     bool erase(const int tid, const int & key); // try to erase key; return true if successful, false otherwise
     long getSumOfKeys(); // should return the sum of all keys in the set
     void printDebuggingDetails(); // print any debugging details you want at the end of a trial in this function
+    void registerMetrics(MetricsRegistry & registry);
 };
 
-SetHashTableLockfree::SetHashTableLockfree(const int _numThreads, const int _size)
+SetHashTableLockfree::SetHashTableLockfree(const int _numThreads, const int _size, const set_options_t & _options)
         : numThreads(_numThreads)
-        , capacity(2*_size) {
-    data = new int[capacity];
+        , reuseTombstones(_options.reuseTombstones) {
+    current = new table_t(max(2*_size, 2), numThreads, NULL);
+    numPasses = 0;
     failed_inserts.init(numThreads);
     successful_inserts.init(numThreads);
     someone_else_inserts.init(numThreads);
     failed_erase.init(numThreads);
     successful_erase.init(numThreads);
-    #pragma omp parallel for
-    for (int i=0;i<capacity;++i) {
-        data[i] = EMPTY;
-    }
+    growth_passes.init(numThreads);
+    compaction_passes.init(numThreads);
+    migrated_chunks.init(numThreads);
+    reused_tombstones.init(numThreads);
+    insert_probes.init(numThreads);
+    erase_probes.init(numThreads);
+    validation_probes.init(numThreads);
+    finished_reservations.init(numThreads);
 }
 
 SetHashTableLockfree::~SetHashTableLockfree() {
-    delete[] data;
+    table_t * t = current;
+    while (t->next) t = t->next;
+    while (t) {
+        table_t * prev = t->prev;
+        delete t;
+        t = prev;
+    }
 }
 
 bool SetHashTableLockfree::insertIfAbsent(const int tid, const int & key) {
-    assert(EMPTY != key && TOMBSTONE != key);
+    assert(key > 0 && key < RESERVED_BIT);
+    if (reuseTombstones) return insertReusingTombstones(tid, key);
     unsigned int const hash = murmur3_32(key);
-    for (unsigned int i = 0 ; i < capacity ; ++i) {
-        unsigned int const index = (hash + i) % capacity;
-        unsigned int found = data[index];
+    table_t * t = current;
+retry:
+    if (t->next) helpMigration(tid, t);
+    for (unsigned int i = 0 ; i < t->capacity ; ++i) {
+        unsigned int const index = (hash + i) % t->capacity;
+        int found = t->data[index];
+        insert_probes.inc(tid);
         if (found == key) {
            failed_inserts.inc(tid);
             return false;
         } else if (found == EMPTY) {
-            auto result = __sync_val_compare_and_swap(&data[index], found, key);
+            auto result = __sync_val_compare_and_swap(&t->data[index], found, key);
             if (result == found) {
                successful_inserts.inc(tid);
+               countSlots(tid, t, 1, 1);
                 return true;
             } else if (result == key) { // key was inserted by someone else
                someone_else_inserts.inc(tid);
                return false;
+            } else if (isMigrating(result)) {
+                t = finishMigration(tid, t);
+                goto retry;
             }
+        } else if (isMigrating(found)) {
+            t = finishMigration(tid, t);
+            goto retry;
         }
     }
-    return false;
+    // probed the whole table without finding room, so grow now instead of failing
+    startMigration(tid, t, true);
+    t = finishMigration(tid, t);
+    goto retry;
+}
+
+/**
+ * Insert that claims the first tombstone (or else the EMPTY slot) on the probe
+ * path, in three phases:
+ *  1. reserve: CAS the slot to key|RESERVED_BIT.
+ *  2. validate: scan the rest of the probe sequence up to the first EMPTY slot.
+ *     If key is there, we lose. If another insert has reserved a slot for key,
+ *     the reservation closer to the start of the probe sequence wins: we
+ *     either kill the other reservation (CAS it to TOMBSTONE) or retract ours.
+ *  3. finalize: CAS our slot from key|RESERVED_BIT to key. This fails if our
+ *     reservation was killed, in which case we start over.
+ * Slots never go back to EMPTY, so two inserts of the same key always see
+ * each other's reservation (or key) during validation, and at most one of
+ * them finalizes. Retracted or killed reservations become TOMBSTONEs. All
+ * inserts must use this path when reuse is enabled, including the ones that
+ * end up in an EMPTY slot.
+ *
+ * An insert that retracts because of a winning reservation doesn't wait for
+ * the winner (which may be descheduled). It validates the winner's slot just
+ * as the winner would, and finalizes it. Whoever finalizes a reservation
+ * (which only takes a full validation scan started after the reservation was
+ * made, so the argument above still holds) inserted key and returns true; if
+ * that isn't the insert that reserved the slot, that insert's own finalize
+ * CAS fails, and when it starts over it finds key and returns false.
+ */
+bool SetHashTableLockfree::insertReusingTombstones(const int tid, const int & key) {
+    unsigned int const hash = murmur3_32(key);
+    int const reservation = key | RESERVED_BIT;
+    table_t * t = current;
+retry:
+    if (t->next) helpMigration(tid, t);
+    {
+        // find the first tombstone or EMPTY slot, unless key is already there
+        int slot = -1;
+        int old = EMPTY;
+        for (unsigned int i = 0 ; i < t->capacity ; ++i) {
+            int found = t->data[(hash + i) % t->capacity];
+            insert_probes.inc(tid);
+            if (found == key) {
+                failed_inserts.inc(tid);
+                return false;
+            } else if (isMigrating(found)) {
+                t = finishMigration(tid, t);
+                goto retry;
+            } else if (found == TOMBSTONE || found == EMPTY) {
+                if (slot < 0) {
+                    slot = i;
+                    old = found;
+                }
+                if (found == EMPTY) break;
+            }
+        }
+        if (slot < 0) { // no room at all
+            startMigration(tid, t, true);
+            t = finishMigration(tid, t);
+            goto retry;
+        }
+
+        // reserve
+        int * const reserved = &t->data[(hash + slot) % t->capacity];
+        if (!__sync_bool_compare_and_swap(reserved, old, reservation)) goto retry;
+        if (old == EMPTY) countSlots(tid, t, 1, 0); // this slot has left EMPTY for good, whatever happens to the reservation
+
+        // validate
+        unsigned int winner;
+        int const outcome = validateReservation(tid, t, hash, key, slot, &winner);
+        if (outcome != VALID) {
+            __sync_bool_compare_and_swap(reserved, reservation, TOMBSTONE); // retract (fails if it was already killed or frozen)
+            if (outcome == FOUND_KEY) {
+                failed_inserts.inc(tid);
+                return false;
+            }
+            if (outcome == FOUND_MIGRATION) {
+                t = finishMigration(tid, t);
+                goto retry;
+            }
+            // the reservation closer to the start wins, so finish it instead of waiting for its insert
+            int * const w = &t->data[(hash + winner) % t->capacity];
+            switch (validateReservation(tid, t, hash, key, winner, &winner)) {
+                case VALID:
+                    if (__sync_bool_compare_and_swap(w, reservation, key)) {
+                        successful_inserts.inc(tid);
+                        finished_reservations.inc(tid);
+                        countSlots(tid, t, 0, 1);
+                        return true;
+                    }
+                    break; // it finalized, or was killed or frozen
+                case FOUND_KEY:
+                    failed_inserts.inc(tid);
+                    return false;
+                case FOUND_MIGRATION:
+                    t = finishMigration(tid, t);
+                    break;
+                default:
+                    break; // a reservation with even more priority showed up
+            }
+            goto retry;
+        }
+
+        // finalize
+        if (!__sync_bool_compare_and_swap(reserved, reservation, key)) goto retry; // killed by an insert with priority, frozen, or finalized by an insert that lost to us
+        successful_inserts.inc(tid);
+        countSlots(tid, t, 0, 1);
+        if (old == TOMBSTONE) reused_tombstones.inc(tid);
+        return true;
+    }
+}
+
+/**
+ * Validation scan for the reservation of key in position slot of key's probe
+ * sequence in t (see insertReusingTombstones), on behalf of whichever insert
+ * made it. Kills the reservations for key that it has priority over.
+ * Returns VALID if nothing is in the way, FOUND_KEY if key is in t,
+ * FOUND_MIGRATION if t is being migrated, and FOUND_WINNER (with its position
+ * in winner) if a reservation for key has priority over this one.
+ */
+int SetHashTableLockfree::validateReservation(const int tid, table_t * t, const unsigned int hash, const int key, const unsigned int slot, unsigned int * winner) {
+    int const reservation = key | RESERVED_BIT;
+    for (unsigned int i = 0 ; i < t->capacity ; ++i) {
+        if (i == slot) continue;
+        int * const p = &t->data[(hash + i) % t->capacity];
+        validation_probes.inc(tid);
+    recheck:
+        int found = *p;
+        if (found == EMPTY) break;
+        if (found == reservation) {
+            if (i < slot) {
+                *winner = i;
+                return FOUND_WINNER;
+            }
+            if (!__sync_bool_compare_and_swap(p, reservation, TOMBSTONE)) goto recheck; // it finalized or retracted first
+        } else if (found == key) {
+            return FOUND_KEY;
+        } else if (isMigrating(found)) {
+            return FOUND_MIGRATION;
+        }
+    }
+    return VALID;
 }
 
 bool SetHashTableLockfree::erase(const int tid, const int & key) {
-    assert(EMPTY != key && TOMBSTONE != key);
+    assert(key > 0 && key < RESERVED_BIT);
     unsigned int const hash = murmur3_32(key);
-    for (unsigned int i = 0 ; i < capacity ; ++i) {
-        unsigned int const index = (hash + i) % capacity;
-        unsigned int found = data[index];
+    table_t * t = current;
+retry:
+    if (t->next) helpMigration(tid, t);
+    for (unsigned int i = 0 ; i < t->capacity ; ++i) {
+        unsigned int const index = (hash + i) % t->capacity;
+        int found = t->data[index];
+        erase_probes.inc(tid);
         if (found == key) {
-            auto result = __sync_val_compare_and_swap(&data[index], key, TOMBSTONE);
-            if (result == key) { successful_erase.inc(tid); return true; }
-            assert(data[index] == TOMBSTONE); // someone else deleted key (by CASing to TOMBSTONE)
+            auto result = __sync_val_compare_and_swap(&t->data[index], key, TOMBSTONE);
+            if (result == key) {
+                successful_erase.inc(tid);
+                countSlots(tid, t, 0, -1);
+                return true;
+            }
+            if (isMigrating(result)) { // key was frozen by a migration before we could delete it
+                t = finishMigration(tid, t);
+                goto retry;
+            }
+            // someone else deleted key (by CASing to TOMBSTONE), and with reuseTombstones the slot may already hold something else
             failed_erase.inc(tid);
             return false; 
         } else if (found == EMPTY) {
             failed_erase.inc(tid);
             return false; // did not find key
+        } else if (isMigrating(found)) {
+            t = finishMigration(tid, t);
+            goto retry;
         }
     }
+    failed_erase.inc(tid);
     return false;
 }
 
+/**
+ * Counts the EMPTY slots a thread claims and the keys it adds or removes in
+ * t's size estimators. Once the used slots pass MAX_LOAD_PERCENT, every
+ * thread that counts anything tries to start the migration (only one wins).
+ * Whatever a thread still has batched when t is replaced is simply dropped
+ * along with t, since the new table is counted from scratch.
+ */
+void SetHashTableLockfree::countSlots(const int tid, table_t * t, const int used, const int live) {
+    if (used) t->usedSlots.add(tid, used);
+    if (live) t->liveKeys.add(tid, live);
+    if (t->usedSlots.aboveThreshold()) startMigration(tid, t, false);
+}
+
+/**
+ * Under insert/erase churn most used slots are tombstones, and doubling the
+ * table every time it fills up would only make it sparser. So we only grow if
+ * the live keys alone would load the new table past MAX_LOAD_PERCENT/2, and
+ * otherwise copy into a table of the same size, which drops all tombstones.
+ *
+ * The new table is allocated first and then published with a CAS; whoever
+ * loses frees its candidate. A thread that merely noticed the load crossing
+ * the threshold leaves it to the first thread that did, but a thread that
+ * can't continue without t->next (needed) allocates a candidate regardless,
+ * so a thread descheduled while allocating doesn't hold anyone up.
+ */
+void SetHashTableLockfree::startMigration(const int tid, table_t * t, const bool needed) {
+    if (t->next) return;
+    if (!needed && (t->resizing || !__sync_bool_compare_and_swap(&t->resizing, 0, 1))) return;
+    bool grow = t->liveKeys.estimate() * 200 > (int64_t) t->capacity * MAX_LOAD_PERCENT
+            || t->usedSlots.estimate() >= t->capacity; // the table is actually full (the estimate lags behind), so grow regardless
+    assert(!grow || t->capacity <= INT_MAX / 2);
+    table_t * next = new table_t(grow ? 2*t->capacity : t->capacity, numThreads, t);
+    if (!__sync_bool_compare_and_swap(&t->next, (table_t *) NULL, next)) { // (the CAS also makes next's fields visible before it is)
+        delete next;
+        return;
+    }
+    if (grow) growth_passes.inc(tid);
+    else compaction_passes.inc(tid);
+}
+
+// migrate one chunk of t, if any are left to claim
+void SetHashTableLockfree::helpMigration(const int tid, table_t * t) {
+    if (t->chunksClaimed >= t->numChunks) return;
+    int chunk = __sync_fetch_and_add(&t->chunksClaimed, 1);
+    if (chunk < t->numChunks) migrateChunk(tid, t, chunk);
+}
+
+/**
+ * Returns t's successor once every chunk of t has been migrated. Once all
+ * chunks are claimed, we migrate the ones that aren't done yet ourselves
+ * (starting from a different chunk in each thread), rather than wait for
+ * the threads that claimed them.
+ */
+SetHashTableLockfree::table_t * SetHashTableLockfree::finishMigration(const int tid, table_t * t) {
+    if (t->next == NULL) startMigration(tid, t, true);
+    while (t->chunksClaimed < t->numChunks && t->chunksDone < t->numChunks) {
+        helpMigration(tid, t);
+    }
+    for (int i = 0; i < t->numChunks && t->chunksDone < t->numChunks; ++i) {
+        int chunk = (i + tid) % t->numChunks;
+        if (!t->chunkDone[chunk]) migrateChunk(tid, t, chunk);
+    }
+    assert(t->chunksDone == t->numChunks);
+    return t->next;
+}
+
+void SetHashTableLockfree::migrateChunk(const int tid, table_t * t, const int chunk) {
+    table_t * next = t->next;
+    int const begin = chunk * MIGRATION_CHUNK;
+    int const end = min(begin + MIGRATION_CHUNK, t->capacity);
+    int64_t copied = 0;
+    int64_t tombstones = 0;
+    int claimed = 0;
+    for (int i = begin; i < end; ++i) {
+        while (true) {
+            int v = t->data[i];
+            if (v == MOVED) break;
+            if (v == EMPTY || v == TOMBSTONE || isReserved(v) || isCopy(v)) { // freezing a reservation kills it, so the insert retries on next
+                if (__sync_bool_compare_and_swap(&t->data[i], v, MOVED)) {
+                    if (v != EMPTY) ++tombstones;
+                    break;
+                }
+            } else if (v > 0) {
+                __sync_bool_compare_and_swap(&t->data[i], v, v | FROZEN_BIT);
+            } else { // frozen by us or by someone else, who may be stalled: copy it (again)
+                if (copyFrozen(tid, t, i, v & ~FROZEN_BIT, &claimed)) ++copied;
+                break;
+            }
+        }
+    }
+    if (claimed) next->usedSlots.add(tid, claimed);
+    if (copied) {
+        next->liveKeys.add(tid, copied);
+        __sync_fetch_and_add(&t->keysCopied, copied);
+    }
+    if (tombstones) __sync_fetch_and_add(&t->tombstonesSeen, tombstones);
+    migrated_chunks.inc(tid);
+    if (!t->chunkDone[chunk] && __sync_bool_compare_and_swap(&t->chunkDone[chunk], 0, 1)
+            && __sync_add_and_fetch(&t->chunksDone, 1) == t->numChunks) {
+        // we finished the last chunk
+        passes[__sync_fetch_and_add(&numPasses, 1) % MAX_PASS_LOG].from = t;
+        __sync_bool_compare_and_swap(&current, t, next);
+    }
+}
+
+/**
+ * Copy key, which is frozen in slot index of t, into t->next, and move the
+ * slot (see the class comment). Any number of threads can do this at once.
+ * Returns true if we are the one whose copy took effect, and adds to claimed
+ * if we took an EMPTY slot in t->next (whether or not the copy took effect).
+ */
+bool SetHashTableLockfree::copyFrozen(const int tid, table_t * t, const int index, const int key, int * claimed) {
+    table_t * next = t->next;
+    int const copy = key | COPY_BITS;
+    unsigned int const hash = murmur3_32(key);
+    int * slot = NULL;
+    for (unsigned int i = 0 ; i < next->capacity ; ++i) {
+        int * const p = &next->data[(hash + i) % next->capacity];
+        int found = *p;
+        if (found == EMPTY) {
+            found = __sync_val_compare_and_swap(p, EMPTY, copy);
+            if (found == EMPTY) {
+                ++*claimed;
+                slot = p;
+                break;
+            }
+        }
+        if (found == copy || found == key) {
+            slot = p;
+            break;
+        }
+    }
+    if (!slot) {
+        // next is at least as large as t, and only gets t's keys until t's migration is done,
+        // so we can only find it full if we're late and it is in use (or being migrated itself)
+        assert(t->data[index] != (key | FROZEN_BIT));
+        return false;
+    }
+
+    bool result = false;
+    if (t->data[index] == (key | FROZEN_BIT)) {
+        // still frozen, so the migration isn't done, and nobody has erased key from next
+        result = __sync_bool_compare_and_swap(slot, copy, key);
+        __sync_bool_compare_and_swap(&t->data[index], key | FROZEN_BIT, MOVED);
+    } else {
+        // we're late: the copy that counts is already in place
+        if (__sync_bool_compare_and_swap(slot, copy, TOMBSTONE)) __sync_fetch_and_add(&t->lateCopies, 1);
+    }
+    return result;
+}
+
 long SetHashTableLockfree::getSumOfKeys() {
+    table_t * t = current;
+    while (t->next) t = finishMigration(0, t); // only called once all threads have stopped, so tid 0's counters are free
     long sum = 0;
     #pragma omp parallel for reduction(+:sum)
-    for (int i=0;i<capacity;++i) {
-        int v = data[i];
+    for (int i=0;i<t->capacity;++i) {
+        int v = t->data[i];
         if (v != TOMBSTONE && v != EMPTY) sum += v;
     }
     return sum;
@@ -128,6 +584,47 @@ void SetHashTableLockfree::printDebuggingDetails() {
       cout << "someone_else_inserts: "<<someone_else_inserts.read()  << endl;
       cout << "failed_erase        : "<<failed_erase.read()          << endl;
       cout << "successful_erase    : "<<successful_erase.read()     << endl;
+      cout << "growth_passes       : "<<growth_passes.read()        << endl;
+      cout << "compaction_passes   : "<<compaction_passes.read()    << endl;
+      cout << "migrated_chunks     : "<<migrated_chunks.read()      << endl;
+      cout << "reused_tombstones   : "<<reused_tombstones.read()    << endl;
+      if (reuseTombstones) cout << "finished_reservations: "<<finished_reservations.read() << endl;
+      long long inserts = failed_inserts.read() + successful_inserts.read() + someone_else_inserts.read();
+      long long erases = failed_erase.read() + successful_erase.read();
+      cout << "avg insert probe len: "<<(inserts ? insert_probes.read() / (double) inserts : 0) << endl;
+      cout << "avg erase probe len : "<<(erases ? erase_probes.read() / (double) erases : 0) << endl;
+      if (reuseTombstones) cout << "avg validation len  : "<<(inserts ? validation_probes.read() / (double) inserts : 0) << endl;
+      cout << "capacity            : "<<current->capacity           << endl;
+      // the new table only receives copies, so its only tombstones are the ones late copiers leave behind
+      if (numPasses > MAX_PASS_LOG) cout << "(" << (numPasses - MAX_PASS_LOG) << " earlier passes not shown)" << endl;
+      for (int i = max(0, numPasses - MAX_PASS_LOG); i < numPasses; ++i) {
+          table_t * from = passes[i % MAX_PASS_LOG].from;
+          int const oldCapacity = from->capacity;
+          int const newCapacity = from->next->capacity;
+          cout << "pass " << i << (newCapacity > oldCapacity ? " (growth)    : " : " (compaction): ")
+               << oldCapacity << " -> " << newCapacity << " slots"
+               << ", tombstone density " << (100. * from->tombstonesSeen / oldCapacity) << "% -> " << (100. * from->lateCopies / newCapacity) << "%"
+               << ", key density " << (100. * from->keysCopied / oldCapacity) << "% -> " << (100. * from->keysCopied / newCapacity) << "%" << endl;
+      }
     
 }
 
+
+void SetHashTableLockfree::registerMetrics(MetricsRegistry & registry) {
+    registry.addCounter("failed_inserts", &failed_inserts);
+    registry.addCounter("successful_inserts", &successful_inserts);
+    registry.addCounter("someone_else_inserts", &someone_else_inserts);
+    registry.addCounter("failed_erase", &failed_erase);
+    registry.addCounter("successful_erase", &successful_erase);
+    registry.addCounter("growth_passes", &growth_passes);
+    registry.addCounter("compaction_passes", &compaction_passes);
+    registry.addCounter("migrated_chunks", &migrated_chunks);
+    registry.addCounter("reused_tombstones", &reused_tombstones);
+    registry.addCounter("insert_probes", &insert_probes);
+    registry.addCounter("erase_probes", &erase_probes);
+    registry.addCounter("validation_probes", &validation_probes);
+    registry.addCounter("finished_reservations", &finished_reservations);
+    registry.addGauge("capacity", [this]() { return (double) current->capacity; }); // tables are only freed with the set, so current is safe to read
+    registry.addGauge("live_keys_estimate", [this]() { return (double) current->liveKeys.estimate(); });
+    registry.addGauge("used_slots_estimate", [this]() { return (double) current->usedSlots.estimate(); });
+}
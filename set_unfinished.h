@@ -6,8 +6,9 @@
 #pragma once
 #include <cassert>
 #include <pthread.h>
-#include <immintrin.h>
+#include "htm.h"
 #include <iostream>
+#include <chrono>
 
 uint32_t murmur(int k) {
    uint32_t h = 0x1a8b714c; // seed
@@ -26,6 +27,17 @@ uint32_t murmur(int k) {
 }
 
 
+/**
+ * Knobs that benchmark_set passes to every set.
+ * A set ignores the ones that don't apply to it.
+ */
+struct set_options_t {
+    bool reuseTombstones;   // SetHashTableLockfree: inserts may claim a tombstone instead of an EMPTY slot
+    bool incrementalGrowth; // Hlock: grow by moving a chunk per operation instead of rehashing everything at once
+    bool backwardShift;     // Hlock: erase pulls later keys of the cluster back instead of leaving a tombstone
+    set_options_t() : reuseTombstones(false), incrementalGrowth(false), backwardShift(false) {}
+};
+
 class SetUnfinished {
 public:
     volatile char padding0[PADDING_BYTES];
@@ -33,15 +45,16 @@ public:
     const int size;
     volatile char padding1[PADDING_BYTES];
 
-    SetUnfinished(const int _numThreads, const int _size);
+    SetUnfinished(const int _numThreads, const int _size, const set_options_t & _options = set_options_t());
     ~SetUnfinished();
     bool insertIfAbsent(const int tid, const int & key); // try to insert key; return true if successful (if it doesn't already exist), false otherwise
     bool erase(const int tid, const int & key); // try to erase key; return true if successful, false otherwise
     long getSumOfKeys(); // should return the sum of all keys in the set
     void printDebuggingDetails(); // print any debugging details you want at the end of a trial in this function
+    void registerMetrics(MetricsRegistry & registry); // add any counters/gauges you want the benchmark to snapshot
 };
 
-SetUnfinished::SetUnfinished(const int _numThreads, const int _size)
+SetUnfinished::SetUnfinished(const int _numThreads, const int _size, const set_options_t & _options)
 : numThreads(_numThreads), size(_size) {
     
 }
@@ -66,75 +79,152 @@ void SetUnfinished::printDebuggingDetails() {
     
 }
 
+void SetUnfinished::registerMetrics(MetricsRegistry & registry) {
+    
+}
+
 
 
 class Hlock {
 public:
-   int padding = 16;
    static const int EMPTY = 0;
    static const int TOMBSTONE = -1;
+   static const int ABORT_EXPAND = 8;          // xabort code: the table has to grow, which can't be done inside a transaction
+   static const int ABORT_LOCK_HELD = 1;       // xabort code: someone holds the fallback lock
+   static const int EXPAND_CHUNK = 16384;      // slots per expansion task
+   static const int MIGRATE_CHUNK = 16;        // slots of the old array each operation moves during incremental growth
+   static const int MAX_COUNTER_BATCH = 5000;  // most a thread's share of the size estimates may lag behind
    volatile char padding0[PADDING_BYTES];
    const int numThreads;
+   const bool incrementalGrowth;
+   const bool backwardShift;
    volatile char padding1[PADDING_BYTES];
    volatile uint64_t size;
+   uint64_t minSize;                           // never shrink below the size we were created with
    volatile char padding2[PADDING_BYTES];
    TryLock lock;
    volatile char padding3[PADDING_BYTES];
    int * data;
    volatile char padding4[PADDING_BYTES];
-   volatile int64_t  *approx_counter_shards;
+   SizeEstimator liveKeys;                     // inserts minus erases
    volatile char padding5[PADDING_BYTES];
-   volatile uint64_t approx_addition = 0;
+   SizeEstimator usedSlots;                    // keys plus tombstones; reset to the live count whenever the table is rebuilt
    volatile char padding6[PADDING_BYTES];
-   Sharded succeed_transactions;
+   StatCounter succeed_transactions;
    volatile char padding7[PADDING_BYTES];
-   Sharded failed_transactions;
+   StatCounter failed_transactions;
    volatile char padding8[PADDING_BYTES];
-   Sharded lock_failed_transactions;
+   StatCounter lock_failed_transactions;
    volatile char padding9[PADDING_BYTES];
-   Sharded expansion_transaction;
+   HTMAbortStats htmStats;                     // why transactions abort, and how often operations end up on the lock
+   volatile char padding9b[PADDING_BYTES];
+   StatCounter expansion_transaction;
    volatile char padding10[PADDING_BYTES];
-   Sharded expansion_regular;
+   StatCounter expansion_regular;
    volatile char padding11[PADDING_BYTES];
+   StatCounter expansion_tasks_helped;
+   StatCounter expansion_micros;
+   volatile char padding12[PADDING_BYTES];
+   // an expansion in progress, split into tasks that threads waiting for the lock claim (see helpExpand)
+   volatile uint64_t expandClaim;              // (generation << 32) | next unclaimed task; odd generation = expansion in progress
+   volatile char padding13[PADDING_BYTES];
+   volatile int expandInitDone;
+   volatile char padding14[PADDING_BYTES];
+   volatile int expandRehashDone;
+   volatile char padding15[PADDING_BYTES];
+   int * expandOld;
+   int * expandNew;
+   uint64_t expandOldSize;
+   uint64_t expandNewSize;
+   int expandInitTasks;                        // tasks [0, expandInitTasks) fill expandNew with EMPTY
+   int expandRehashTasks;                      // the following expandRehashTasks tasks rehash one chunk of expandOld each
+   volatile char padding16[PADDING_BYTES];
+   // incremental growth: the old array stays readable next to data until every chunk of it has been moved
+   volatile uint64_t migrateClaim;             // (generation << 32) | next unclaimed chunk
+   volatile char padding17[PADDING_BYTES];
+   volatile uint64_t migrateDone;              // (generation << 32) | chunks moved
+   volatile char padding18[PADDING_BYTES];
+   volatile int migrateGeneration;             // odd = migration in progress; only changes under the lock
+   int * volatile oldData;                     // NULL unless a migration is in progress
+   uint64_t oldSize;
+   int migrateChunks;
+   volatile char padding19[PADDING_BYTES];
+   StatCounter migrated_chunks;
+   volatile char padding20[PADDING_BYTES];
+   StatCounter shrinks;
+   volatile char padding21[PADDING_BYTES];
+   StatCounter cleanups;                       // rebuilds at the same size to get rid of tombstones
+   volatile char padding22[PADDING_BYTES];
+   StatCounter shifted_keys;
+   volatile char padding23[PADDING_BYTES];
    
-   Hlock(const int _numThreads, const int _size);
+   Hlock(const int _numThreads, const int _size, const set_options_t & _options = set_options_t());
    ~Hlock();
    int insertIfAbsent(const int tid, const int & key); // try to insert key; return true if successful (if it doesn't already exist), false otherwise
    bool erase(const int tid, const int & key); // try to erase key; return true if successful, false otherwise
    long getSumOfKeys(); // should return the sum of all keys in the set
    void printDebuggingDetails(); // print any debugging details you want at the end of a trial in this function
+   void registerMetrics(MetricsRegistry & registry);
    int insertHTM(const int tid, const int & key); //  insert
    bool eraseHTM(const int tid, const int & key);
-   void expand();
-   int64_t inc(int tid);
-   int64_t read();
+   void expand(const int tid, const uint64_t newSize);
+   bool helpExpand(const int tid, const bool byLockHolder = false);
+   void startMigration(const int tid, const uint64_t newSize);
+   int64_t claimMigrationChunk();
+   void migrateChunk(const int tid, const int64_t claim);
+   void finishMigrationChunk(const int tid, const int64_t claim);
+   void completeMigration(const int tid);
+   int64_t findOld(const int & key);
+   void shiftBack(const int tid, uint64_t hole);
+   bool resizeNeeded();
+   uint64_t resizeTarget();
+   bool resize(const int tid, const bool requestedByTransaction);
+   void setErrorBound();
+   void armThresholds();
 };
 
-Hlock::Hlock(const int _numThreads, const int _size)
+Hlock::Hlock(const int _numThreads, const int _size, const set_options_t & _options)
    : numThreads(_numThreads)
-   , size(2 * _size) {
+   , incrementalGrowth(_options.incrementalGrowth)
+   , backwardShift(_options.backwardShift)
+   , size(2 * _size)
+   , minSize(2 * _size) {
    succeed_transactions.init(numThreads);
    failed_transactions.init(numThreads);
    lock_failed_transactions.init(numThreads);
+   htmStats.init(numThreads);
+   htmStats.nameCode(ABORT_EXPAND, "expand");
+   htmStats.nameCode(ABORT_LOCK_HELD, "lock_held");
    expansion_transaction.init(numThreads);
    expansion_regular.init(numThreads);
-   data = new int[size];
-   approx_counter_shards = new int64_t[_numThreads *padding];
+   expansion_tasks_helped.init(numThreads);
+   migrated_chunks.init(numThreads);
+   shrinks.init(numThreads);
+   cleanups.init(numThreads);
+   expansion_micros.init(numThreads);
+   shifted_keys.init(numThreads);
+   expandClaim = 0;
+   migrateClaim = 0;
+   migrateDone = 0;
+   migrateGeneration = 0;
+   oldData = NULL;
+   data = (int *) malloc(size * sizeof(int));
+   liveKeys.init(numThreads, 0);
+   usedSlots.init(numThreads, 0);
+   setErrorBound();
+   armThresholds();
    lock.release();
 
 #pragma omp parallel for
    for (int i = 0; i < size; ++i) {
       data[i] = EMPTY;
    }
-#pragma omp parallel for
-   for (int i = 0; i < _numThreads * padding; i += padding){ 
-      approx_counter_shards[i*padding] = 0; 
-   }
 
 }
 
 Hlock::~Hlock() {
-   delete[] data;// destructor
+   free(data);// destructor
+   if (oldData) free(oldData);
 }
 
 int Hlock::insertIfAbsent(const int tid, const int & key) {
@@ -143,59 +233,58 @@ int Hlock::insertIfAbsent(const int tid, const int & key) {
 
 
       int retriesLeft = 5;
-      unsigned status = _XABORT_EXPLICIT;
-      bool result = 0;
+      int attempts = 0;
+      unsigned status = HTM_ABORT_EXPLICIT;
+      int result = 0;
+      int64_t const claim = claimMigrationChunk(); // -1 unless incremental growth is in progress
    retry:
-      status = _xbegin();
-      if (status == _XBEGIN_STARTED)
+      ++attempts;
+      status = htm_begin(tid);
+      if (status == HTM_STARTED)
       {
-          int64_t current_counts = read();
-         if (current_counts > (size/2))
+         if (resizeNeeded())
             {
-              while (lock.tryAcquire() == false) { /* wait */ }
-            expand();
-            lock.release();
-            expansion_transaction.inc(tid);
-            return 2;
+            htm_abort(ABORT_EXPAND); // expand under the lock, where waiting threads can help
             }
          if ((lock.isHeld() == true)) { 
-             lock_failed_transactions.inc(tid);
-             _xabort(_XABORT_CODE(7)); 
+             htm_abort(ABORT_LOCK_HELD); 
          }
+          migrateChunk(tid, claim);
           result = insertHTM(tid, key);
-         _xend();
+         htm_end();
          succeed_transactions.inc(tid);
-         return result;
+         htmStats.recordCommit(tid, attempts);
       }
 
       else {
           failed_transactions.inc(tid);
-         while (lock.isHeld() == true) { /* wait */ }
-         if (--retriesLeft > 0) { goto retry; }
-         while (lock.tryAcquire() == false) { /* wait */ }
-         int64_t current_counts = read();
-         if (current_counts > (size/2))
-         {
-            expand();
-            lock.release();
-            expansion_regular.inc(tid);
-            return 2;
-         }
-             result = insertHTM(tid, key);
-            lock.release();
-            return result;
-
+          htmStats.recordAbort(tid, status);
+         // (counted here: a counter incremented inside the transaction would be rolled back with it)
+         if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == ABORT_LOCK_HELD) lock_failed_transactions.inc(tid);
+         bool expandRequested = (status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == ABORT_EXPAND;
+         while (lock.isHeld() == true) { helpExpand(tid); }
+         if (!expandRequested && --retriesLeft > 0) { goto retry; }
+         htmStats.recordFallback(tid);
+         while (lock.tryAcquire() == false) { helpExpand(tid); }
+         migrateChunk(tid, claim);
+         if (resizeNeeded()) resize(tid, expandRequested); // (grow, shrink or clean up, then insert into the new table)
+         result = insertHTM(tid, key);
+         lock.release();
       }
-   return 0;
+   finishMigrationChunk(tid, claim);
+   return result;
  
 }
 
 
 
 int Hlock::insertHTM(const int tid, const int & key) {
+   if (oldData && findOld(key) >= 0) { // not moved to data yet
+      return 0;
+   }
 
    unsigned int const hash = murmur(key);
-   for (unsigned int i = 0; i < size; ++i) {
+   for (uint64_t i = 0; i < size; ++i) {
 
       unsigned int const index = (hash + i) % size;
        int found = data[index];
@@ -206,7 +295,8 @@ int Hlock::insertHTM(const int tid, const int & key) {
 
       else if (found == EMPTY) {
          data[index] = key;
-         inc(tid);
+         liveKeys.inc(tid);
+         usedSlots.inc(tid);
          return 1;
       }
    }
@@ -219,36 +309,64 @@ int Hlock::insertHTM(const int tid, const int & key) {
 bool Hlock::erase(const int tid, const int & key) {
    assert(EMPTY != key && TOMBSTONE != key);
       int retriesLeft = 5;
+      int attempts = 0;
       bool result = false;
-      unsigned status = _XABORT_EXPLICIT;
+      unsigned status = HTM_ABORT_EXPLICIT;
+      int64_t const claim = claimMigrationChunk(); // -1 unless incremental growth is in progress
    retry:
-      status = _xbegin();
-      if (status == _XBEGIN_STARTED)
+      ++attempts;
+      status = htm_begin(tid);
+      if (status == HTM_STARTED)
       {
-         if ((lock.isHeld() == true)) { _xabort(1); }
+         if (resizeNeeded()) { htm_abort(ABORT_EXPAND); } // mostly empty or mostly tombstones
+         if ((lock.isHeld() == true)) { htm_abort(ABORT_LOCK_HELD); }
+          migrateChunk(tid, claim);
           result = eraseHTM(tid, key);
-         _xend();
-         return result;
+         htm_end();
+         htmStats.recordCommit(tid, attempts);
       }
       else {
-         while (lock.isHeld() == true) { /* wait */ }
-         if (--retriesLeft > 0) { goto retry; }
-         while (lock.tryAcquire() == false) { /* wait */ }
+         htmStats.recordAbort(tid, status);
+         if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == ABORT_LOCK_HELD) lock_failed_transactions.inc(tid);
+         bool expandRequested = (status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == ABORT_EXPAND;
+         while (lock.isHeld() == true) { helpExpand(tid); }
+         if (!expandRequested && --retriesLeft > 0) { goto retry; }
+         htmStats.recordFallback(tid);
+         while (lock.tryAcquire() == false) { helpExpand(tid); }
+         migrateChunk(tid, claim);
+         if (resizeNeeded()) resize(tid, expandRequested);
          result = eraseHTM(tid, key);
          lock.release();
-         return result;
       }
-   return false;
+   finishMigrationChunk(tid, claim);
+   return result;
 }
 
 bool Hlock::eraseHTM(const int tid, const int & key) {
+   if (oldData) {
+      int64_t const index = findOld(key);
+      if (index >= 0) { // not moved to data yet
+         oldData[index] = TOMBSTONE;
+         liveKeys.dec(tid);
+         return true;
+      }
+   }
+
    unsigned int const hash = murmur(key);
 
-   for (unsigned int i = 0; i < size; ++i) {
+   for (uint64_t i = 0; i < size; ++i) {
       unsigned int const index = (hash + i) % size;
        int found = data[index];
       if (found == key){
-         data[index] = TOMBSTONE;
+         if (backwardShift) {
+            shiftBack(tid, index);
+            liveKeys.dec(tid);
+            usedSlots.dec(tid);
+         }
+         else {
+            data[index] = TOMBSTONE;
+            liveKeys.dec(tid);
+         }
          return true;
       }
       else if (found == EMPTY){
@@ -267,6 +385,12 @@ long Hlock::getSumOfKeys() {
       int v = data[i];
       if (v != TOMBSTONE && v != EMPTY) sum += v;
    }
+   if (oldData) { // a migration was still in progress when the trial ended
+      for (uint64_t i = 0; i < oldSize; ++i) {
+         int v = oldData[i];
+         if (v != TOMBSTONE && v != EMPTY) sum += v;
+      }
+   }
    return sum;
 }
 ////////////////////////////////////////////////////////////////////////////////
@@ -278,61 +402,317 @@ void Hlock::printDebuggingDetails() {
    cout << "lock_failed_transactions: " <<lock_failed_transactions.read() << endl;
    cout << "expansion_transaction: " <<expansion_transaction.read() << endl;
    cout << "expansion_regular: " <<expansion_regular.read() << endl;
+   cout << "expansion_tasks_helped: " <<expansion_tasks_helped.read() << endl;
+   cout << "expansion_pause_ms: " <<expansion_micros.read() / 1000. << endl;
+   cout << "growth_mode: " <<(incrementalGrowth ? "incremental" : "stop-the-world") << endl;
+   cout << "migrated_chunks: " <<migrated_chunks.read() << endl;
+   cout << "shrinks: " <<shrinks.read() << endl;
+   cout << "tombstone_cleanups: " <<cleanups.read() << endl;
+   cout << "final_size: " <<size << endl;
+   cout << "live_keys_estimate: " <<liveKeys.estimate() << endl;
+   cout << "erase_mode: " <<(backwardShift ? "backward-shift" : "tombstone") << endl;
+   if (backwardShift) cout << "shifted_keys: " <<shifted_keys.read() << endl;
+   cout << "htm_backend: " <<htm_backend_name() << endl;
+   htmStats.print(cout);
+
+}
 
+void Hlock::registerMetrics(MetricsRegistry & registry) {
+   registry.addCounter("succeed_transactions", &succeed_transactions);
+   registry.addCounter("failed_transactions", &failed_transactions);
+   registry.addCounter("lock_failed_transactions", &lock_failed_transactions);
+   htmStats.registerMetrics(registry);
+   registry.addCounter("expansion_transaction", &expansion_transaction);
+   registry.addCounter("expansion_regular", &expansion_regular);
+   registry.addCounter("expansion_tasks_helped", &expansion_tasks_helped);
+   registry.addCounter("expansion_micros", &expansion_micros);
+   registry.addCounter("migrated_chunks", &migrated_chunks);
+   registry.addCounter("shrinks", &shrinks);
+   registry.addCounter("tombstone_cleanups", &cleanups);
+   registry.addCounter("shifted_keys", &shifted_keys);
+   registry.addGauge("size", [this]() { return (double) size; });
+   registry.addGauge("live_keys_estimate", [this]() { return (double) liveKeys.estimate(); });
+   registry.addGauge("used_slots_estimate", [this]() { return (double) usedSlots.estimate(); });
 }
 ////////////////////////////////////////////////////////////////////////////////
 
 //Expansion of hash table///////////////////////////////////////////////////////
-void Hlock::expand() {
-
-   uint64_t old_size = size;
-   
-   size = size * 2;
-   
-   int* new_data = new int[size]; //new size
+// Called with the lock held. Instead of rehashing alone while everyone else
+// spins on the lock, we publish the expansion as a list of tasks, and threads
+// waiting for the lock claim and run them (see helpExpand).
+void Hlock::expand(const int tid, const uint64_t newSize) {
+   auto start = std::chrono::high_resolution_clock::now();
+
+   expandOld = data;
+   expandOldSize = size;
+   expandNewSize = newSize;
+   expandNew = (int *) malloc(expandNewSize * sizeof(int)); //new size
+   expandInitTasks = (expandNewSize + EXPAND_CHUNK - 1) / EXPAND_CHUNK;
+   expandRehashTasks = (expandOldSize + EXPAND_CHUNK - 1) / EXPAND_CHUNK;
+   expandInitDone = 0;
+   expandRehashDone = 0;
+   __sync_synchronize(); // publish the fields above before the tasks can be claimed
+   uint64_t generation = (expandClaim >> 32) + 1;
+   expandClaim = generation << 32;
+
+   while (expandRehashDone < expandRehashTasks) { helpExpand(tid, true); }
+   expandClaim = (generation + 1) << 32; // every task is done, so nobody touches expandOld any more
+
+   free(data);
+   data = expandNew;
+   size = expandNewSize;
+   usedSlots.reset(liveKeys.sum()); // the rebuilt table has no tombstones
+   setErrorBound();
+   armThresholds();
+   expansion_micros.add(tid, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count());
+}
 
-   for (int i = 0; i < size; ++i) {
-      new_data[i] = EMPTY;
+// Claim and run one task of the expansion in progress.
+// Returns false if there was nothing left to claim.
+bool Hlock::helpExpand(const int tid, const bool byLockHolder) {
+   uint64_t claim = expandClaim;
+   if (((claim >> 32) & 1) == 0) return false; // no expansion in progress
+   int task = (int) (claim & 0xffffffff);
+   if (task >= expandInitTasks + expandRehashTasks) return false;
+   if (!__sync_bool_compare_and_swap(&expandClaim, claim, claim + 1)) return true; // the fields we read belong to the expansion we claimed from
+   if (!byLockHolder) expansion_tasks_helped.inc(tid);
+
+   if (task < expandInitTasks) {
+      uint64_t const begin = (uint64_t) task * EXPAND_CHUNK;
+      uint64_t const end = min(begin + EXPAND_CHUNK, expandNewSize);
+      for (uint64_t i = begin; i < end; ++i) {
+         expandNew[i] = EMPTY;
+      }
+      __sync_fetch_and_add(&expandInitDone, 1);
+      return true;
    }
 
+   while (expandInitDone < expandInitTasks) { /* wait for the new array to be initialized by the other tasks */ }
    //save data here with rehashed values
-   for (int i = 0; i < old_size; ++i) {
-      if (EMPTY != data[i] && TOMBSTONE != data[i])
+   uint64_t const begin = (uint64_t) (task - expandInitTasks) * EXPAND_CHUNK;
+   uint64_t const end = min(begin + EXPAND_CHUNK, expandOldSize);
+   for (uint64_t i = begin; i < end; ++i) {
+      int const key = expandOld[i];
+      if (EMPTY != key && TOMBSTONE != key)
       {
-         unsigned int const hash = murmur(data[i]);
-         int x = 0;
+         unsigned int const hash = murmur(key);
+         uint64_t x = 0;
          do {
-            unsigned int const index = (hash + x) % size;
-            if (new_data[index] == EMPTY) {
-               new_data[index] = data[i];
+            unsigned int const index = (hash + x) % expandNewSize;
+            if (expandNew[index] == EMPTY && __sync_bool_compare_and_swap(&expandNew[index], EMPTY, key)) { // other tasks rehash into expandNew concurrently
                break;
             }
             else { x++; }
-         } while (x < size);
-         assert(x < size); //-DNDEBUG remove asserts from complile
+         } while (x < expandNewSize);
+         assert(x < expandNewSize); //-DNDEBUG remove asserts from complile
       }
    }
-   //cout << "Expansion Succed" << endl;
-   delete[] data;
-   data= new_data;
+   __sync_fetch_and_add(&expandRehashDone, 1);
+   return true;
+}
+////////////////////////////////////////////////////////////////////////////////
+
+//Resizing//////////////////////////////////////////////////////////////////////
+// Probe lengths depend on used slots (keys + tombstones), memory should follow
+// live keys. Once used passes 1/2 we rebuild: twice as big if live is above
+// 3/8, otherwise at the same size just to drop the tombstones. We shrink when
+// live drops below 1/8. A rebuilt table has used == live, and that lands well
+// inside both thresholds (after growing: live > 3/16 of the new size, after
+// shrinking: live < 1/4), so a steady key count can't make us bounce back and
+// forth between growing and shrinking.
+
+// The fast path, run inside every transaction: only reads the estimators'
+// threshold flags, which are written once per resize, not on every flush.
+bool Hlock::resizeNeeded() {
+   return usedSlots.aboveThreshold() || liveKeys.belowThreshold();
+}
+
+// While an incremental migration is in progress we don't shrink, and only
+// step in if data fills up anyway (the migration is stuck behind a
+// descheduled thread holding a chunk). Called with the lock held.
+void Hlock::armThresholds() {
+   bool const canShrink = size/2 >= minSize && !(incrementalGrowth && oldData);
+   usedSlots.setThresholds(LLONG_MIN, size/2);
+   liveKeys.setThresholds(canShrink ? (long long) (size/8) : LLONG_MIN, LLONG_MAX);
+}
+
+// The estimates may be off by size/16 (but at most MAX_COUNTER_BATCH per
+// thread); a batch that doesn't shrink with the table would let a small table
+// fill up (or empty out) long before anyone noticed.
+void Hlock::setErrorBound() {
+   long long const maxError = min((long long) size / 16, (long long) numThreads * MAX_COUNTER_BATCH);
+   liveKeys.setMaxError(maxError);
+   usedSlots.setMaxError(maxError);
+}
+
+// Size the table should be rebuilt at, or 0 if it's fine as it is.
+// Called with the lock held, and with no migration in progress.
+uint64_t Hlock::resizeTarget() {
+   int64_t const used = usedSlots.estimate();
+   int64_t const live = liveKeys.estimate();
+   if (used > (int64_t) (size/2)) {
+      return (live > (int64_t) (size/8*3)) ? size * 2 : size; // mostly tombstones: same size, just without them
+   }
+   if (live < (int64_t) (size/8) && size/2 >= minSize) {
+      return size / 2;
+   }
+   return 0;
+}
+
+// Called with the lock held. Returns false if it turned out there was
+// nothing to do beyond completing a migration.
+bool Hlock::resize(const int tid, const bool requestedByTransaction) {
+   if (incrementalGrowth && oldData) completeMigration(tid);
+   uint64_t const newSize = resizeTarget();
+   if (!newSize) {
+      armThresholds(); // a flag from before the last rebuild, or the count has since come back
+      return false;
+   }
+   uint64_t const oldSize = size;
+   if (incrementalGrowth) startMigration(tid, newSize);
+   else expand(tid, newSize);
+   if (newSize < oldSize) shrinks.inc(tid);
+   else if (newSize == oldSize) cleanups.inc(tid);
+   else if (requestedByTransaction) expansion_transaction.inc(tid);
+   else expansion_regular.inc(tid);
+   return true;
 }
 ////////////////////////////////////////////////////////////////////////////////
 
-// Approximate counter implementation for resizing Hash table///////////////////
-int64_t Hlock::inc(int tid)
-{
-   approx_counter_shards[tid * padding]++;
-   if (approx_counter_shards[tid * padding] >= 5000)
-   {
-      int64_t w = approx_counter_shards[tid *padding];
-      approx_counter_shards[tid * padding] = 0;
-      __sync_add_and_fetch(&approx_addition, w);
+//Incremental growth////////////////////////////////////////////////////////////
+// Instead of stopping everyone while the table is rehashed, the old array is
+// kept next to the new one and every insert/erase moves one MIGRATE_CHUNK of it
+// inside its own transaction (or under the lock) before doing its own work.
+// Lookups check the old array first, since a key lives in exactly one of them.
+
+
+// Called with the lock held. calloc hands back zeroed pages (EMPTY == 0),
+// so nothing proportional to the table size happens here.
+void Hlock::startMigration(const int tid, const uint64_t newSize) {
+   int * fresh = (int *) calloc(newSize, sizeof(int));
+   int const generation = migrateGeneration + 1;
+   oldSize = size;
+   migrateChunks = (oldSize + MIGRATE_CHUNK - 1) / MIGRATE_CHUNK;
+   migrateDone = (uint64_t) generation << 32;
+   migrateGeneration = generation;
+   oldData = data;
+   data = fresh;
+   size = newSize;
+   usedSlots.reset(liveKeys.sum()); // every key still in oldData will land in fresh, and nothing else is there yet
+   setErrorBound();
+   armThresholds();
+   __sync_synchronize(); // publish the fields above before chunks can be claimed
+   migrateClaim = (uint64_t) generation << 32;
+}
+
+// Claim the next chunk of the migration in progress, outside any transaction,
+// so transactions never conflict on the claim word.
+// Returns (generation << 32) | chunk, or -1 if there is nothing to claim.
+int64_t Hlock::claimMigrationChunk() {
+   if (!incrementalGrowth) return -1;
+   while (true) {
+      uint64_t claim = migrateClaim;
+      if (((claim >> 32) & 1) == 0) return -1; // no migration in progress
+      int chunk = (int) (claim & 0xffffffff);
+      if (chunk >= migrateChunks) return -1;
+      if (__sync_bool_compare_and_swap(&migrateClaim, claim, claim + 1)) return (int64_t) claim;
+   }
+}
+
+// Runs inside the caller's transaction or under the lock. If the migration we
+// claimed from was completed by someone else in the meantime, there's nothing to do.
+void Hlock::migrateChunk(const int tid, const int64_t claim) {
+   if (claim < 0 || (int) (claim >> 32) != migrateGeneration) return;
+   uint64_t const begin = (uint64_t) (claim & 0xffffffff) * MIGRATE_CHUNK;
+   uint64_t const end = min(begin + MIGRATE_CHUNK, oldSize);
+   for (uint64_t i = begin; i < end; ++i) {
+      int const key = oldData[i];
+      if (key == EMPTY || key == TOMBSTONE) continue;
+      // key can't be in data yet (inserts look in oldData first), so a tombstone is as good as an EMPTY slot
+      unsigned int const hash = murmur(key);
+      uint64_t x = 0;
+      for (; x < size; ++x) {
+         unsigned int const index = (hash + x) % size;
+         if (data[index] == EMPTY || data[index] == TOMBSTONE) {
+            data[index] = key;
+            break;
+         }
+      }
+      assert(x < size);
+      oldData[i] = TOMBSTONE; // keeps probe sequences through oldData intact
    }
-   return approx_addition;
 }
 
-int64_t Hlock::read()
-{
-   return approx_addition;
+// Called after the transaction or lock that moved the chunk is gone.
+// Whoever moves the last chunk retires oldData; taking the lock aborts every
+// transaction that might still be reading it.
+void Hlock::finishMigrationChunk(const int tid, const int64_t claim) {
+   if (claim < 0) return;
+   uint64_t const generation = (uint64_t) claim >> 32;
+   uint64_t done;
+   do {
+      done = migrateDone;
+      if ((done >> 32) != generation) return; // completed by someone else (see completeMigration)
+   } while (!__sync_bool_compare_and_swap(&migrateDone, done, done + 1));
+   migrated_chunks.inc(tid);
+   if ((int) (done & 0xffffffff) + 1 < migrateChunks) return;
+   while (lock.tryAcquire() == false) { /* wait */ }
+   if (migrateGeneration == (int) generation) completeMigration(tid);
+   lock.release();
 }
-////////////////////////////////////////////////////////////////////////////////
\ No newline at end of file
+
+// Called with the lock held. Moves whatever is left (chunks already moved are
+// all tombstones by now, so moving them again is a no-op) and retires oldData.
+// Chunks claimed by threads that haven't run yet become no-ops for them.
+void Hlock::completeMigration(const int tid) {
+   int const generation = migrateGeneration;
+   for (int chunk = 0; chunk < migrateChunks; ++chunk) {
+      migrateChunk(tid, ((int64_t) generation << 32) | chunk);
+   }
+   migrateGeneration = generation + 1;
+   migrateDone = (uint64_t) (generation + 1) << 32;
+   migrateClaim = (uint64_t) (generation + 1) << 32;
+   int * old = oldData;
+   oldData = NULL;
+   free(old);
+   armThresholds(); // shrinking is allowed again
+}
+
+//Backward-shift deletion///////////////////////////////////////////////////////
+// Runs inside the caller's transaction or under the lock, so the whole shift
+// is atomic. Walks the rest of the cluster after the erased slot and pulls back
+// every key whose probe sequence passes through the hole, so the cluster stays
+// unbroken without a tombstone. Only used on data: oldData is on its way out
+// and its tombstones double as "moved" marks (see migrateChunk).
+void Hlock::shiftBack(const int tid, uint64_t hole) {
+   uint64_t j = hole;
+   while (true) {
+      j = (j + 1) % size;
+      int const key = data[j];
+      if (key == EMPTY) break;
+      if (key == TOMBSTONE) continue; // only from before a mode switch; harmless to leave
+      uint64_t const home = murmur(key) % size;
+      // key may move to hole if hole is at or after its home position, i.e., between home and j
+      if ((j + size - home) % size >= (j + size - hole) % size) {
+         data[hole] = key;
+         hole = j;
+         shifted_keys.inc(tid);
+      }
+   }
+   data[hole] = EMPTY;
+}
+////////////////////////////////////////////////////////////////////////////////
+
+// Index of key in oldData, or -1.
+int64_t Hlock::findOld(const int & key) {
+   unsigned int const hash = murmur(key);
+   for (uint64_t i = 0; i < oldSize; ++i) {
+      unsigned int const index = (hash + i) % oldSize;
+      int const found = oldData[index];
+      if (found == key) return index;
+      if (found == EMPTY) return -1;
+   }
+   return -1;
+}
+////////////////////////////////////////////////////////////////////////////////
+
@@ -2,6 +2,8 @@
 #define UTIL_H
 
 #include <chrono>
+#include <climits>
+#include <algorithm>
 
 class ElapsedTimer {
 private:
@@ -84,6 +86,105 @@ public:
     }
 } __attribute__((aligned(PADDING_BYTES)));
 
+/**
+ * Approximate count (e.g., keys in a set) that scales with the thread count.
+ * Each thread adds into its own padded shard with plain stores, and only folds
+ * the shard into the shared total once it reaches +-batch, where
+ * batch = maxError / numThreads, so estimate() is off by at most maxError.
+ *
+ * Callers that only care whether the count has left some range (say, "time to
+ * grow the table") register the range with setThresholds and poll
+ * aboveThreshold() / belowThreshold(). Those read a flag that is written only
+ * when a flush crosses a threshold, not the total that every flush writes, so
+ * polling them is cheap even inside a hardware transaction.
+ */
+class SizeEstimator {
+private:
+    static const int ABOVE = 1;
+    static const int BELOW = 2;
+    struct PaddedShard {
+        volatile char padding[PADDING_BYTES-sizeof(long long)];
+        volatile long long v;
+    };
+    PaddedShard * shards;
+    int numThreads;
+    int batch;
+    volatile char padding0[PADDING_BYTES];
+    volatile long long total;
+    volatile char padding1[PADDING_BYTES];
+    volatile long long below;
+    volatile long long above;
+    volatile int crossed; // ABOVE and/or BELOW, set by the flush that crossed the threshold
+    volatile char padding2[PADDING_BYTES];
+
+    void check(const long long t) {
+        int c = (t > above ? ABOVE : 0) | (t < below ? BELOW : 0);
+        if (c & ~crossed) __sync_fetch_and_or(&crossed, c);
+    }
+public:
+    SizeEstimator() : shards(NULL), numThreads(0), batch(1), total(0), below(LLONG_MIN), above(LLONG_MAX), crossed(0) {}
+    ~SizeEstimator() {
+        delete[] shards;
+    }
+    void init(const int _numThreads, const long long maxError) {
+        numThreads = _numThreads;
+        shards = new PaddedShard[numThreads];
+        for (int tid=0;tid<numThreads;++tid) shards[tid].v = 0;
+        total = 0;
+        setMaxError(maxError);
+    }
+    // deltas already sitting in shards are flushed against the new batch size
+    void setMaxError(const long long maxError) {
+        batch = (int) std::max(1LL, std::min((long long) INT_MAX, maxError / numThreads));
+    }
+    void add(const int tid, const long long delta) {
+        long long v = shards[tid].v + delta;
+        if (v < batch && v > -batch) {
+            shards[tid].v = v;
+            return;
+        }
+        shards[tid].v = 0;
+        check(__sync_add_and_fetch(&total, v));
+    }
+    void inc(const int tid) {
+        add(tid, 1);
+    }
+    void dec(const int tid) {
+        add(tid, -1);
+    }
+    // within maxError of the true count
+    long long estimate() {
+        return total;
+    }
+    // total plus whatever is still in the shards (exact if nobody is adding)
+    long long sum() {
+        long long result = total;
+        for (int tid=0;tid<numThreads;++tid) result += shards[tid].v;
+        return result;
+    }
+    // make the count equal value from now on (deltas still in shards are
+    // taken to be part of value); call while nobody is adding
+    void reset(const long long value) {
+        long long pending = sum() - total;
+        total = value - pending;
+    }
+    // from now on, belowThreshold() becomes true once estimate() < _below,
+    // and aboveThreshold() once estimate() > _above
+    void setThresholds(const long long _below, const long long _above) {
+        below = _below;
+        above = _above;
+        crossed = 0;
+        __sync_synchronize();
+        check(total);
+    }
+    bool aboveThreshold() {
+        return crossed & ABOVE;
+    }
+    bool belowThreshold() {
+        return crossed & BELOW;
+    }
+} __attribute__((aligned(PADDING_BYTES)));
+
 struct TryLock {
     int volatile state;
     TryLock() {
@@ -100,42 +201,54 @@ struct TryLock {
         return state;
     }
 };
-class Sharded {
+/**
+ * Statistics counter. Every thread has its own cache line that only it
+ * writes, with a plain load and store (no lock, no atomic read-modify-write),
+ * and read() sums the lines with relaxed loads without stopping anyone, so
+ * it's wait-free and exact once the writers are done.
+ *
+ * Compile with -DNO_STATS to turn every StatCounter into a no-op that reads 0.
+ */
+#ifndef NO_STATS
+class StatCounter {
 private:
-   pthread_spinlock_t *lock;
-   int padding = 16;
-   int volatile *v; // no padding needed here since this only points to a memory location
-   int number;
+    struct PaddedSlot {
+        volatile char padding[PADDING_BYTES-sizeof(long long)];
+        long long v;
+    };
+    PaddedSlot * slots;
+    int number;
 public:
-   Sharded(){}
-  void init(int _numThreads)
-   {
-      number = _numThreads;
-      v = new int[_numThreads*padding];
-      lock = new pthread_spinlock_t[_numThreads*padding];
-      for (int i = 0; i < _numThreads; i ++) { v[i*padding] = 0; }
-      for (int i = 0; i < _numThreads; i ++) {pthread_spin_init(&lock[i*padding], 0);}
-      }
-
-      int64_t inc(int tid) // <-- should be void
-      {
-         pthread_spin_lock(&lock[tid* padding]);
-         v[tid * padding]++;
-         pthread_spin_unlock(&lock[tid* padding]);
-
-         return 0; // <-- no return needed
-      }
-      int64_t read()
-      {
-         int cont = 0;
-         for (int x = 0; x < number; x++) { pthread_spin_lock(&lock[x*padding]); }
-
-         for (int x = 0; x < number; x++) { cont += v[x*padding]; }
-
-         for (int x = 0; x < number; x++) { pthread_spin_unlock(&lock[x*padding]); }
+    StatCounter() : slots(NULL), number(0) {}
+    ~StatCounter() {
+        delete[] slots;
+    }
+    void init(const int _numThreads) {
+        number = _numThreads;
+        slots = new PaddedSlot[number];
+        for (int tid=0;tid<number;++tid) slots[tid].v = 0;
+    }
+    void add(const int tid, const long long val) {
+        __atomic_store_n(&slots[tid].v, __atomic_load_n(&slots[tid].v, __ATOMIC_RELAXED) + val, __ATOMIC_RELAXED);
+    }
+    void inc(const int tid) {
+        add(tid, 1);
+    }
+    long long read() {
+        long long result = 0;
+        for (int tid=0;tid<number;++tid) result += __atomic_load_n(&slots[tid].v, __ATOMIC_RELAXED);
+        return result;
+    }
+};
+#else
+class StatCounter {
+public:
+    void init(const int _numThreads) {}
+    void add(const int tid, const long long val) {}
+    void inc(const int tid) {}
+    long long read() { return 0; }
+};
+#endif
 
-         return cont;
-      }
-   };
 #endif /* UTIL_H */
 